@@ -2,24 +2,145 @@
 #define FSTDICT_FST_H
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdio>
 #include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <set>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+// std::pmr (C++17) lets callers give the builder a memory resource; see
+// BuildOptions::memory.
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && __cplusplus >= 201703L
+#include <memory_resource>
+#define FSTDICT_HAS_PMR 1
+#endif
+#endif
+
+// MSVC doesn't define __SSE2__, but every x64 target has it.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FSTDICT_SSE2 1
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(FSTDICT_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace {
 
+// countTrailingZeros returns the index of the lowest set bit of x, which must not be 0.
+inline unsigned countTrailingZeros(uint32_t x) {
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return (unsigned)i;
+#else
+  return (unsigned)__builtin_ctz(x);
+#endif
+}
+
+// popCount returns the number of set bits of x.
+inline unsigned popCount(uint64_t x) {
+#if defined(_MSC_VER) && defined(_M_X64)
+  return (unsigned)__popcnt64(x);
+#elif defined(_MSC_VER)
+  return (unsigned)(__popcnt((uint32_t)x) + __popcnt((uint32_t)(x >> 32)));
+#else
+  return (unsigned)__builtin_popcountll(x);
+#endif
+}
+
+// commonPrefixLen compares 32 or 16 bytes at a time where SIMD is available.
 size_t commonPrefixLen(const std::string &a, const std::string &b) {
-  return std::mismatch(a.begin(), a.end(), b.begin()).first - a.begin();
+  const size_t n = std::min(a.size(), b.size());
+  const char *p = a.data();
+  const char *q = b.data();
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(q + i));
+    uint32_t ne = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+    if (ne != 0) {
+      return i + countTrailingZeros(ne);
+    }
+  }
+#endif
+#if defined(FSTDICT_SSE2)
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(q + i));
+    uint32_t ne = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xFFFF;
+    if (ne != 0) {
+      return i + countTrailingZeros(ne);
+    }
+  }
+#endif
+  return i + (std::mismatch(p + i, p + n, q + i).first - (p + i));
+}
+
+// findByte returns the offset of the first c in p[0, n), or n; it scans 32 or 16
+// bytes at a time where SIMD is available.
+size_t findByte(const char *p, size_t n, char c) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i c32 = _mm256_set1_epi8(c);
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    uint32_t eq = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, c32)));
+    if (eq != 0) {
+      return i + countTrailingZeros(eq);
+    }
+  }
+#endif
+#if defined(FSTDICT_SSE2)
+  const __m128i c16 = _mm_set1_epi8(c);
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    uint32_t eq = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, c16)));
+    if (eq != 0) {
+      return i + countTrailingZeros(eq);
+    }
+  }
+#endif
+  for (; i < n && p[i] != c; ++i) {
+  }
+  return i;
 }
 
 // T must be an unsigned integer type
@@ -37,11 +158,10 @@ void WriteUint(std::ostream *os, T value) {
 template<typename T>
 T ReadUint(std::istream *is) {
   T value = 0;
-  char buf;
+  char buf = 0;
   for (size_t i = 0; i < sizeof(T); ++i) {
-    value *= 256;
     is->read(&buf, 1);
-    value |= static_cast<unsigned char>(buf);
+    value |= static_cast<T>(static_cast<unsigned char>(buf)) << (8 * i);
   }
   return value;
 }
@@ -50,6 +170,7 @@ T ReadUint(std::istream *is) {
 
 namespace FstDict {
 
+using std::array;
 using std::cerr;
 using std::dec;
 using std::endl;
@@ -72,6 +193,8 @@ using std::string;
 using std::stringstream;
 using std::swap;
 using std::unordered_map;
+using std::unordered_multimap;
+using std::unordered_set;
 using std::uppercase;
 using std::vector;
 
@@ -84,13 +207,34 @@ struct Pair {
   }
 };
 
+// State is a node of the automaton under construction. With std::pmr its containers
+// take a memory resource, so a build can run out of an arena.
 struct State {
-  int id;
-  unordered_map<uint8_t, shared_ptr<State>> trans;
-  unordered_map<uint8_t, int32_t> output;
-  set<int32_t> tail;
-  bool isFinal;
-  int64_t hcode;
+#ifdef FSTDICT_HAS_PMR
+  template <typename K, typename V>
+  using Map = std::pmr::unordered_map<K, V>;
+  using TailSet = std::pmr::set<int32_t>;
+  using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+  State() = default;
+  explicit State(const allocator_type &a) : trans(a), output(a), tail(a) {}
+  State(const State &s, const allocator_type &a)
+      : id(s.id), trans(s.trans, a), output(s.output, a), tail(s.tail, a),
+        isFinal(s.isFinal), hcode(s.hcode) {}
+  State(const State &) = default;
+  State &operator=(const State &) = default;
+#else
+  template <typename K, typename V>
+  using Map = unordered_map<K, V>;
+  using TailSet = set<int32_t>;
+#endif
+
+  int id = 0;
+  Map<uint8_t, shared_ptr<State>> trans;
+  Map<uint8_t, int32_t> output;
+  TailSet tail;
+  bool isFinal = false;
+  int64_t hcode = 0;
 
   bool hasTail() {
     return !tail.empty();
@@ -100,7 +244,7 @@ struct State {
     tail.insert(t);
   }
 
-  const set<int32_t> &getTails() {
+  const TailSet &getTails() {
     return tail;
   }
 
@@ -119,14 +263,14 @@ struct State {
     if (out == 0) {
       return;
     }
-    output.insert(make_pair(ch, out));
+    output[ch] = out;
 
     constexpr int magic = 8191;
     hcode += ((int64_t)ch + out) * magic;
   }
 
   void setTransition(uint8_t ch, shared_ptr<State> next) {
-    trans.insert(make_pair(ch, next));
+    trans[ch] = next;
 
     constexpr int magic = 1001;
     hcode += ((int64_t)ch + next->id) * magic;
@@ -168,8 +312,9 @@ struct State {
     for (const auto &it : trans) {
       const auto &ch = it.first;
       const auto &tr = it.second;
-      const auto &out = output.at(ch);
-      ss << hex << uppercase << setw(2) << setfill('0') << ch
+      const auto o = output.find(ch);
+      const auto out = o != output.end() ? o->second : 0;
+      ss << hex << uppercase << setw(2) << setfill('0') << (int)ch
          << "/" << dec << out
          << "-->" << hex << setw(sizeof(tr)*2) << tr << ", ";
     }
@@ -190,11 +335,17 @@ enum class Operation : uint8_t {
   Match = 3,
   Break = 4,
   Output = 5,
-  OutputBreak = 6
+  OutputBreak = 6,
+  // superinstructions picked by buildMachine
+  OutputAccept = 7,  // Output into a final state with no edges and no tail
+  OutputAcceptBreak = 8,
+  MatchMatch = 9,  // Match into a non-final state whose only edge is a Break
+  BreakMatch = 10
 };
 
 string getOperationString(Operation op) {
-  static const char* opStr[] = { "NA", "ACC", "ACB", "MTC", "BRK", "OUT", "OUB" };
+  static const char* opStr[] = {
+    "NA", "ACC", "ACB", "MTC", "BRK", "OUT", "OUB", "OAC", "OAB", "MMT", "BMT" };
   static size_t opStrLen = sizeof(opStr) / sizeof(opStr[0]);
   uint8_t opNum = static_cast<uint8_t>(op);
   if (opNum < opStrLen) {
@@ -212,6 +363,147 @@ union Instruction {
   int32_t v32;
 };
 
+// isOutput reports whether op carries an output operand.
+inline bool isOutput(Operation op) {
+  return op == Operation::Output || op == Operation::OutputBreak ||
+         op == Operation::OutputAccept || op == Operation::OutputAcceptBreak;
+}
+
+// RankIndex maps marked positions of the program to dense indexes, so that operands
+// can live in cold arrays outside the instruction stream.
+struct RankIndex {
+  vector<uint64_t> bits;
+  vector<uint32_t> ranks;  // marked positions before each 64-bit block
+
+  void reset(size_t n) {
+    bits.assign((n + 63) / 64, 0);
+    ranks.clear();
+  }
+
+  void mark(size_t i) {
+    bits[i / 64] |= uint64_t(1) << (i % 64);
+  }
+
+  bool marked(size_t i) const {
+    return (bits[i / 64] >> (i % 64)) & 1;
+  }
+
+  // finish computes the block ranks once all positions are marked.
+  void finish() {
+    ranks.resize(bits.size());
+    uint32_t r = 0;
+    for (size_t b = 0; b < bits.size(); ++b) {
+      ranks[b] = r;
+      r += popCount(bits[b]);
+    }
+  }
+
+  // rank returns the number of marked positions before i.
+  uint32_t rank(size_t i) const {
+    uint64_t below = bits[i / 64] & ((uint64_t(1) << (i % 64)) - 1);
+    return ranks[i / 64] + popCount(below);
+  }
+};
+
+// BloomFilter is a blocked Bloom filter over the keywords: all k bits of a key fall in
+// one 512-bit block, so a negative answer costs a single cache line.
+struct BloomFilter {
+  uint8_t k = 0;  // bits probed per key, 0 if the filter is empty
+  vector<uint64_t> words;  // 8 words per block
+
+  bool empty() const {
+    return words.empty();
+  }
+
+  size_t bytes() const {
+    return words.size() * sizeof(uint64_t);
+  }
+
+  // reset sizes an empty filter for n keys at bitsPerKey, with the optimal k.
+  void reset(size_t n, uint32_t bitsPerKey) {
+    k = (uint8_t)std::max(1, std::min(16, (int)std::lround(bitsPerKey * 0.69)));
+    words.assign(8 * std::max<size_t>(1, (n * bitsPerKey + 511) / 512), 0);
+  }
+
+  void add(const string &key) {
+    uint64_t h = hash(key);
+    uint64_t *block = &words[8 * blockOf(h)];
+    uint64_t g = h * 0x9E3779B97F4A7C15ULL;
+    uint32_t a = (uint32_t)g, b = (uint32_t)(g >> 32) | 1;
+    for (uint8_t i = 0; i < k; ++i, a += b) {
+      block[(a >> 23) / 64] |= uint64_t(1) << ((a >> 23) % 64);
+    }
+  }
+
+  bool mayContain(const string &key) const {
+    uint64_t h = hash(key);
+    const uint64_t *block = &words[8 * blockOf(h)];
+    uint64_t g = h * 0x9E3779B97F4A7C15ULL;
+    uint32_t a = (uint32_t)g, b = (uint32_t)(g >> 32) | 1;
+    for (uint8_t i = 0; i < k; ++i, a += b) {
+      if ((block[(a >> 23) / 64] & (uint64_t(1) << ((a >> 23) % 64))) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // expectedFpr estimates the false positive rate with n keys, ignoring the block
+  // load variance (the real rate is slightly higher).
+  double expectedFpr(size_t n) const {
+    if (empty()) {
+      return 1;
+    }
+    return std::pow(1 - std::exp(-(double)k * n / (words.size() * 64)), k);
+  }
+
+  // hash is a portable 64-bit string hash, so images are valid across platforms.
+  static uint64_t hash(const string &key) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (key.size() * 0xFF51AFD7ED558CCDULL);
+    size_t i = 0;
+    for (; i + 8 <= key.size(); i += 8) {
+      uint64_t v = 0;
+      for (int b = 0; b < 8; ++b) {
+        v |= uint64_t((uint8_t)key[i+b]) << (8 * b);
+      }
+      h = (h ^ v) * 0xC4CEB9FE1A85EC53ULL;
+      h ^= h >> 29;
+    }
+    uint64_t v = 0;
+    for (int b = 0; i < key.size(); ++i, ++b) {
+      v |= uint64_t((uint8_t)key[i]) << (8 * b);
+    }
+    h = (h ^ v) * 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+ private:
+  // blockOf maps the high half of h onto the blocks without a division.
+  size_t blockOf(uint64_t h) const {
+    return (size_t)(((h >> 32) * (words.size() / 8)) >> 32);
+  }
+};
+
+// DenseTable is a state x byte class transition table for batch membership checks.
+// A cell holds the next state's row offset shifted left by one with the state's final
+// flag in bit 0, or -1 if there is no edge, so a lookup is one load per input byte.
+struct DenseTable {
+  uint32_t width = 0;  // number of byte classes
+  int32_t root = -1;  // cell value of the initial state
+  vector<int32_t> cells;
+
+  bool empty() const {
+    return cells.empty();
+  }
+
+  size_t bytes() const {
+    return cells.size() * sizeof(int32_t);
+  }
+};
+
 // Configuration represents a FST (virtual machine) configuration.
 struct Configuration {
   int pc;  // program counter
@@ -220,10 +512,312 @@ struct Configuration {
   Configuration(int pc, int hd) : pc(pc), hd(hd) {};
 };
 
+// LatticeHit is a keyword found in a sentence by FST::Lattice: the bytes
+// [begin, begin+len), whose outputs are [from, to) of the output array filled alongside.
+struct LatticeHit {
+  uint32_t begin;
+  uint32_t len;
+  uint32_t from;
+  uint32_t to;
+};
+
+// Transition is an edge of a compiled state decoded from the program.
+struct Transition {
+  uint8_t ch;  // input label
+  int32_t out;  // output (0 if the edge has no Output operand)
+  int next;  // pc of the destination state
+};
+
+// StateCode is a state of a compiled program decoded for tooling.
+struct StateCode {
+  bool isFinal = false;
+  int tailFrom = -1;  // range of tails in data, -1 if the accept emits the last output
+  int tailTo = -1;
+  vector<Transition> edges;
+};
+
+// ExportOptions configures FST::Export.
+struct ExportOptions {
+  enum class Format { Dot, Json };
+  Format format = Format::Dot;
+  // the export starts from the states on the path of key (the initial state if empty)
+  string key;
+  size_t depth = 3;  // levels exported below the start states
+  size_t maxStates = 10000;  // size cap; the export is truncated beyond it
+};
+
+// WarmupOptions configures FST::Warmup.
+struct WarmupOptions {
+  bool willNeed = true;  // madvise(MADV_WILLNEED) the program and data pages
+  bool lockProgram = false;  // mlock the instruction stream
+  size_t samples = 1024;  // number of profile lookups to replay
+  // keys to replay; if null, a profile is sampled from the program itself
+  const vector<string> *profile = nullptr;
+};
+
+// PageLock owns an mlock of a page range and unlocks it when released or destroyed.
+// Copies don't share the lock; a move hands it over, which keeps it valid for the
+// vector buffers of a moved FST.
+struct PageLock {
+  uintptr_t begin = 0;
+  size_t len = 0;
+
+  PageLock() = default;
+  PageLock(const PageLock &) {}
+  PageLock(PageLock &&other) noexcept : begin(other.begin), len(other.len) {
+    other.len = 0;
+  }
+  PageLock &operator=(const PageLock &other) {
+    if (this != &other) {
+      release();
+    }
+    return *this;
+  }
+  PageLock &operator=(PageLock &&other) noexcept {
+    if (this != &other) {
+      release();
+      begin = other.begin;
+      len = other.len;
+      other.len = 0;
+    }
+    return *this;
+  }
+  ~PageLock() { release(); }
+
+  // lock locks the pages spanning [addr, addr + n), releasing any previous range.
+  bool lock(const void *addr, size_t n) {
+    release();
+#if defined(__unix__) || defined(__APPLE__)
+    if (n == 0) {
+      return true;
+    }
+    const uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t b = (uintptr_t)addr & ~(pageSize - 1);
+    size_t l = (uintptr_t)addr + n - b;
+    if (mlock((void *)b, l) != 0) {
+      return false;
+    }
+    begin = b;
+    len = l;
+    return true;
+#else
+    (void)addr;
+    return n == 0;
+#endif
+  }
+
+  void release() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (len != 0) {
+      munlock((void *)begin, len);
+    }
+#endif
+    len = 0;
+  }
+
+  bool locked() const { return len != 0; }
+};
+
+struct Cursor;
+
+// ProgramStats summarizes a compiled program.
+struct ProgramStats {
+  size_t instructions = 0;  // opcodes, including inlined Breaks; not operand words
+  size_t farJumps = 0;  // jumps needing an extra 32-bit word
+  size_t words = 0;  // prog size
+  size_t prefilterBytes = 0;
+  size_t bytes = 0;  // image size: prog, data, operand tables and prefilter
+};
+
+// OptimizeStats reports the effect of FST::Optimize.
+struct OptimizeStats {
+  ProgramStats before;
+  ProgramStats after;
+};
+
 // FST represents a finite state transducer (virtual machine).
 struct FST {
+  // The hot instruction stream holds only opcodes and far jump words. Output operands
+  // and tail ranges sit in cold arrays, so edges that fail to match never pull them
+  // into cache.
   vector<Instruction> prog;
-  vector<int32_t> data;
+  vector<int32_t> data;  // tails
+  vector<int32_t> outs;  // operand of each Output instruction, in program order
+  vector<int32_t> tailRanges;  // [from, to) in data of each Accept with tails
+  RankIndex outIndex;  // pc of an Output instruction -> outs
+  RankIndex tailIndex;  // pc of an Accept with tails -> tailRanges / 2
+  // Edge labels are byte class ids: input bytes are mapped through classes before they
+  // are compared, so bytes that behave alike everywhere share a single edge.
+  array<uint8_t, 256> classes = identityClasses();
+  array<uint16_t, 257> classFirst;  // members of class c: classMembers[classFirst[c], classFirst[c+1])
+  array<uint8_t, 256> classMembers;
+  // Reachability per state, by the rank of its first pc in stateIndex: the fewest edges
+  // to a final state strictly below, saturated at 255, and the largest of these over
+  // states that have a final state below. Like the rank indexes they are derived from
+  // prog by index().
+  RankIndex stateIndex;
+  vector<uint8_t> minBelow;
+  uint8_t minBelowMax = 0;
+  size_t minKeyLen = 0;  // shortest and longest keyword
+  size_t maxKeyLen = 0;
+  DenseTable dense;  // built on demand by BuildDenseTable
+  BloomFilter prefilter;  // BuildOptions::prefilterBitsPerKey, for whole-key lookups
+  // An acceptor (BuildOptions::acceptor) has no Output instructions and no tails;
+  // Search reports {0} for its keys.
+  bool acceptor = false;
+  // index found the program to pass Verify. The lookups run the program without bounds
+  // checks, so they treat a program that was not verified as empty; code that edits
+  // the arrays must call index again.
+  bool verified = false;
+  // WarmupOptions::lockProgram; unlocked by Unlock, or when prog is replaced by Read or
+  // Optimize or the FST is destroyed
+  PageLock programLock;
+
+  static array<uint8_t, 256> identityClasses() {
+    array<uint8_t, 256> cls;
+    for (int b = 0; b < 256; ++b) {
+      cls[b] = (uint8_t)b;
+    }
+    return cls;
+  }
+
+  // index verifies the program and rebuilds outIndex, tailIndex, the class members and
+  // the reachability from prog and classes. Returns verified, with the reason in err
+  // (if given) when it is false.
+  bool index(string *err = nullptr) {
+    classFirst.fill(0);
+    for (int b = 0; b < 256; ++b) {
+      ++classFirst[classes[b] + 1];
+    }
+    for (int c = 0; c < 256; ++c) {
+      classFirst[c+1] += classFirst[c];
+    }
+    auto fill = classFirst;
+    for (int b = 0; b < 256; ++b) {
+      classMembers[fill[classes[b]]++] = (uint8_t)b;
+    }
+
+    outIndex.reset(prog.size());
+    tailIndex.reset(prog.size());
+    for (size_t pc = 0; pc < prog.size(); ++pc) {
+      const auto &code = prog[pc];
+      switch (code.ops.op) {
+      case Operation::Accept:
+      case Operation::AcceptBreak:
+        if (code.ops.ch != 0) {
+          tailIndex.mark(pc);
+        }
+        break;
+      default:
+        // the Break inlined after a MatchMatch is an instruction of its own
+        if (isOutput(code.ops.op)) {
+          outIndex.mark(pc);
+        }
+        if (code.ops.jump == 0) {
+          ++pc;
+        }
+        break;
+      }
+    }
+    outIndex.finish();
+    tailIndex.finish();
+    string reason;
+    verified = Verify(&reason);
+    if (!verified && err != nullptr) {
+      *err = reason;
+    }
+    annotate();
+    return verified;
+  }
+
+  // runnable reports whether the lookups may run the program.
+  bool runnable() const {
+    return verified && !prog.empty();
+  }
+
+  // annotate computes the reachability of every state. Jumps only go forward, so one
+  // ascending pass finds the state starts and one descending pass sees children first.
+  void annotate() {
+    stateIndex.reset(prog.size());
+    minKeyLen = maxKeyLen = 0;
+    if (!runnable()) {
+      stateIndex.finish();
+      minBelow.clear();
+      minBelowMax = 0;
+      return;
+    }
+    size_t n = 1;
+    stateIndex.mark(0);
+    for (size_t pc = 0; pc < prog.size(); ++pc) {
+      if (!stateIndex.marked(pc)) {
+        continue;
+      }
+      forEachEdge((int)pc, [this, &n](const Transition &t) {
+        if (!stateIndex.marked(t.next)) {
+          stateIndex.mark(t.next);
+          ++n;
+        }
+      });
+    }
+    stateIndex.finish();
+
+    const uint32_t none = UINT32_MAX;
+    vector<uint32_t> lo(n, none), hi(n, 0);
+    for (size_t pc = prog.size(); pc-- > 0;) {
+      if (!stateIndex.marked(pc)) {
+        continue;
+      }
+      auto r = stateIndex.rank(pc);
+      forEachEdge((int)pc, [&](const Transition &t) {
+        auto c = stateIndex.rank(t.next);
+        auto op = prog[t.next].ops.op;
+        uint32_t d = (op == Operation::Accept || op == Operation::AcceptBreak) ? 1 :
+                     lo[c] == none ? none : lo[c] + 1;
+        lo[r] = std::min(lo[r], d);
+        hi[r] = std::max(hi[r], hi[c] + 1);
+      });
+    }
+    minBelow.resize(n);
+    minBelowMax = 0;
+    for (size_t r = 0; r < n; ++r) {
+      minBelow[r] = (uint8_t)std::min<uint32_t>(lo[r], 255);
+      if (lo[r] != none) {
+        minBelowMax = std::max(minBelowMax, minBelow[r]);
+      }
+    }
+    auto op = prog[0].ops.op;
+    minKeyLen = (op == Operation::Accept || op == Operation::AcceptBreak) ? 0 : lo[0];
+    maxKeyLen = hi[0];
+  }
+
+  // outOfReach reports whether no final state lies strictly below the state at pc within
+  // the remaining input. The state is only looked up for remainders shorter than
+  // minBelowMax, where the answer can be yes, so most steps cost a compare. A pc that
+  // isn't a state start has no entry and is never out of reach.
+  bool outOfReach(int pc, size_t remaining) const {
+    return remaining < minBelowMax && stateIndex.marked(pc) &&
+           remaining < minBelow[stateIndex.rank(pc)];
+  }
+
+  // outputAt returns the operand of the Output instruction at pc.
+  int32_t outputAt(int pc) const {
+    return outs[outIndex.rank(pc)];
+  }
+
+  // forEachByte calls f(b) for each byte b of class c in increasing order.
+  template <typename F>
+  void forEachByte(uint8_t c, F f) const {
+    for (auto i = classFirst[c]; i < classFirst[c+1]; ++i) {
+      f(classMembers[i]);
+    }
+  }
+
+  // tailAt returns the tail range of the Accept at pc.
+  void tailAt(int pc, int32_t *from, int32_t *to) const {
+    auto k = tailIndex.rank(pc);
+    *from = tailRanges[2*k];
+    *to = tailRanges[2*k+1];
+  }
 
   // toString returns debug codes of a fst virtual machine.
   string toString() {
@@ -237,20 +831,14 @@ struct FST {
       case Operation::Accept:
       case Operation::AcceptBreak: {
         ss << setw(3) << pc << " " << getOperationString(op)
-           << "\t" << dec << ch << " " << jump << endl;
-        if (ch == 0) {
-          break;
-        }
-        ++pc;
-        code = &prog[pc];
-        auto &to = code->v32;
-        ss << setw(3) << pc << " [" << to << "]" << endl;
-        ++pc;
-        code = &prog[pc];
-        auto &from = code->v32;
-        ss << setw(3) << pc << " [" << from << "] ";
-        for (int i = from; i < to; ++i) {
-          ss << data[i] << ", ";  // FIXME
+           << "\t" << dec << (int)ch << " " << jump;
+        if (ch != 0) {
+          int32_t from, to;
+          tailAt(pc, &from, &to);
+          ss << " [" << from << ", " << to << ") ";
+          for (int i = from; i < to; ++i) {
+            ss << data[i] << ", ";
+          }
         }
         ss << endl;
         break;
@@ -258,8 +846,8 @@ struct FST {
       case Operation::Match:
       case Operation::Break: {
         ss << setw(3) << pc << " " << getOperationString(op)
-           << "\t" << hex << setfill('0') << setw(2) << ch
-           << "(" << dec << ch << ") " << jump << endl;
+           << "\t" << hex << setfill('0') << setw(2) << (int)ch
+           << "(" << dec << (int)ch << ") " << setfill(' ') << jump << endl;
         if (jump == 0) {
           ++pc;
           code = &prog[pc];
@@ -268,19 +856,30 @@ struct FST {
         }
         break;
       }
+      case Operation::MatchMatch:
+      case Operation::BreakMatch: {
+        ss << setw(3) << pc << " " << getOperationString(op)
+           << "\t" << hex << setfill('0') << setw(2) << (int)ch
+           << "(" << dec << (int)ch << ") " << setfill(' ') << jump << endl;
+        ++pc;
+        code = &prog[pc];
+        ss << setw(3) << pc << " \t" << hex << setfill('0') << setw(2) << (int)code->ops.ch
+           << "(" << dec << (int)code->ops.ch << ") " << setfill(' ') << code->ops.jump << endl;
+        break;
+      }
       case Operation::Output:
-      case Operation::OutputBreak: {
+      case Operation::OutputBreak:
+      case Operation::OutputAccept:
+      case Operation::OutputAcceptBreak: {
         ss << setw(3) << pc << " " << getOperationString(op)
-           << "\t" << hex << setfill('0') << setw(2) << ch
-           << "(" << dec << ch << ") " << jump << endl;
+           << "\t" << hex << setfill('0') << setw(2) << (int)ch
+           << "(" << dec << (int)ch << ") " << setfill(' ') << jump << endl;
+        ss << setw(3) << "" << "  out[" << outputAt(pc) << "]" << endl;
         if (jump == 0) {
           ++pc;
           code = &prog[pc];
           ss << setw(3) << pc << " jmp[" << code->v32 << "]" << endl;
         }
-        ++pc;
-        code = &prog[pc];
-        ss << setw(3) << pc << " [" << code->v32 << "]" << endl;
         break;
       }
       default: {
@@ -291,15 +890,244 @@ struct FST {
     return ss.str();
   }
 
-  vector<Configuration> run(string input, bool *accept) {
+  // decodeState decodes the state whose code starts at pc.
+  StateCode decodeState(int pc) const {
+    StateCode s;
+    if (pc < 0 || pc >= (int)prog.size()) {
+      return s;
+    }
+    const auto &code = prog[pc];
+    if (code.ops.op == Operation::Accept || code.ops.op == Operation::AcceptBreak) {
+      s.isFinal = true;
+      if (code.ops.ch != 0) {
+        tailAt(pc, &s.tailFrom, &s.tailTo);
+      }
+    }
+    forEachEdge(pc, [&s](const Transition &t) {
+      s.edges.push_back(t);
+    });
+    return s;
+  }
+
+  // forEachEdge calls f(Transition) for each edge of the state whose code starts at pc.
+  template <typename F>
+  void forEachEdge(int pc, F f) const {
+    auto op = prog[pc].ops.op;
+    if (op == Operation::Accept || op == Operation::AcceptBreak) {
+      if (op == Operation::AcceptBreak) {
+        return;
+      }
+      ++pc;
+    }
+    while (pc < (int)prog.size()) {
+      const auto &code = prog[pc];
+      op = code.ops.op;
+      Transition t{code.ops.ch, 0, 0};
+      if (op == Operation::MatchMatch || op == Operation::BreakMatch) {
+        // the second word only matters to run
+        t.next = pc + code.ops.jump;
+        pc += 2;
+        f(t);
+        if (op == Operation::BreakMatch) {
+          break;
+        }
+        continue;
+      }
+      if (isOutput(op)) {
+        t.out = outputAt(pc);
+      } else if (op != Operation::Match && op != Operation::Break) {
+        break;
+      }
+      if (code.ops.jump > 0) {
+        t.next = pc + code.ops.jump;
+      } else {
+        ++pc;
+        t.next = pc + prog[pc].v32;
+      }
+      ++pc;
+      f(t);
+      if (op == Operation::Break || op == Operation::OutputBreak ||
+          op == Operation::OutputAcceptBreak) {
+        break;
+      }
+    }
+  }
+
+  // transition follows the edge for input byte b of the state whose code starts at pc and
+  // returns the pc of the next state, or -1. If Outputs, an edge output is stored in *out.
+  template <bool Outputs>
+  int transition(int pc, uint8_t b, int32_t *out) const {
+    const uint8_t ch = classes[b];
+    const Instruction *code = &prog[pc];
+    if (code->ops.op == Operation::Accept) {
+      ++pc;
+    } else if (code->ops.op == Operation::AcceptBreak) {
+      return -1;
+    }
+    for (;;) {
+      code = &prog[pc];
+      const auto jump = code->ops.jump;
+      switch (code->ops.op) {
+      case Operation::Match:
+      case Operation::Break: {
+        if (code->ops.ch == ch) {
+          return jump > 0 ? pc + jump : pc + 1 + prog[pc+1].v32;
+        }
+        if (code->ops.op == Operation::Break) {
+          return -1;
+        }
+        pc += jump > 0 ? 1 : 2;
+        continue;
+      }
+      case Operation::MatchMatch:
+      case Operation::BreakMatch: {
+        if (code->ops.ch == ch) {
+          return pc + jump;
+        }
+        if (code->ops.op == Operation::BreakMatch) {
+          return -1;
+        }
+        pc += 2;
+        continue;
+      }
+      case Operation::Output:
+      case Operation::OutputBreak:
+      case Operation::OutputAccept:
+      case Operation::OutputAcceptBreak: {
+        if (code->ops.ch == ch) {
+          if (Outputs) {
+            *out = outputAt(pc);
+          }
+          return jump > 0 ? pc + jump : pc + 1 + prog[pc+1].v32;
+        }
+        if (code->ops.op == Operation::OutputBreak ||
+            code->ops.op == Operation::OutputAcceptBreak) {
+          return -1;
+        }
+        pc += jump > 0 ? 1 : 2;
+        continue;
+      }
+      default:
+        return -1;
+      }
+    }
+  }
+
+  // step returns the pc of the state reached from the state at pc by ch, or -1.
+  int step(int pc, uint8_t ch) const {
+    int32_t out;
+    return transition<false>(pc, ch, &out);
+  }
+
+  // lookup walks the whole input and returns the pc of the final state's Accept,
+  // or -1 if the input is not accepted. No configurations are recorded.
+  template <bool Outputs>
+  int lookup(const string &input, int32_t *out) const {
+    if (!runnable() || input.size() < minKeyLen || input.size() > maxKeyLen ||
+        (!prefilter.empty() && !prefilter.mayContain(input))) {
+      return -1;
+    }
+    int pc = 0;
+    for (auto c : input) {
+      pc = transition<Outputs>(pc, (uint8_t)c, out);
+      if (pc < 0) {
+        return -1;
+      }
+    }
+    auto op = prog[pc].ops.op;
+    if (op != Operation::Accept && op != Operation::AcceptBreak) {
+      return -1;
+    }
+    return pc;
+  }
+
+  // prefixes calls f(length, pc, out) for each keyword that is a prefix of input[from:],
+  // in increasing length; pc is the keyword's Accept and out the last edge output (only
+  // tracked if Outputs). f returns false to stop.
+  template <bool Outputs, typename F>
+  void prefixes(const string &input, F f, size_t from = 0) const {
+    if (!runnable()) {
+      return;
+    }
+    int pc = 0;
+    int32_t out = 0;
+    for (size_t i = from;; ++i) {
+      auto op = prog[pc].ops.op;
+      if ((op == Operation::Accept || op == Operation::AcceptBreak) &&
+          !f((int)(i - from), pc, out)) {
+        return;
+      }
+      if (i == input.size() || outOfReach(pc, input.size() - i)) {
+        return;
+      }
+      pc = transition<Outputs>(pc, (uint8_t)input[i], &out);
+      if (pc < 0) {
+        return;
+      }
+    }
+  }
+
+  // outputsAt returns the outputs of the Accept at pc given the last edge output.
+  vector<int32_t> outputsAt(int pc, int32_t out) const {
+    if (prog[pc].ops.ch == 0) {
+      return vector<int32_t>{out};
+    }
+    int32_t from, to;
+    tailAt(pc, &from, &to);
+    return vector<int32_t>(data.begin() + from, data.begin() + to);
+  }
+
+  // sampleKeys returns n keys chosen by deterministic random walks from the initial state.
+  vector<string> sampleKeys(size_t n) const {
+    vector<string> keys;
+    if (!runnable()) {
+      return keys;
+    }
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < n; ++i) {
+      string key;
+      int pc = 0;
+      for (;;) {
+        auto s = decodeState(pc);
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        if (s.edges.empty() || (s.isFinal && seed % 4 == 0)) {
+          break;
+        }
+        const auto &t = s.edges[(seed >> 8) % s.edges.size()];
+        key.push_back((char)classMembers[classFirst[t.ch]]);
+        pc = t.next;
+      }
+      keys.push_back(move(key));
+    }
+    return keys;
+  }
+
+  // run executes the program on input and records a configuration for every Accept
+  // reached. If dispatches is given, the number of dispatched instructions is added to it.
+  // pc is not bounds-checked: programs come from buildMachine or pass Verify in Read.
+  vector<Configuration> run(const string &input, bool *accept, size_t *dispatches = nullptr) {
     vector<Configuration> snap;
     int pc = 0;  // program counter
     int hd = 0;  // input head
-    int32_t out;  // output
+    int32_t out = 0;  // output
     *accept = false;
     Operation op;
+    if (!runnable()) {
+      return snap;
+    }
+    // stop reports that the non-final state at pc has no final state within the input
+    auto stop = [this, &input, &hd](int at) {
+      auto op = prog[at].ops.op;
+      return op != Operation::Accept && op != Operation::AcceptBreak &&
+             outOfReach(at, input.size() - hd);
+    };
 
-    while (pc < prog.size() && hd <= input.size()) {
+    for (;;) {
+      if (dispatches) {
+        ++*dispatches;
+      }
       auto code = &prog[pc];  // tmp instruction
       op = code->ops.op;  // operation
       auto &ch = code->ops.ch;  // char
@@ -307,10 +1135,10 @@ struct FST {
       switch (op) {
       case Operation::Match:
       case Operation::Break: {
-        if (hd == input.size()) {
+        if (hd == (int)input.size()) {
           goto L_END;
         }
-        if (ch != input[hd]) {
+        if (ch != classes[(uint8_t)input[hd]]) {
           if (op == Operation::Break) {
             return snap;
           }
@@ -328,27 +1156,57 @@ struct FST {
           pc += code->v32;
         }
         ++hd;
+        if (stop(pc)) {
+          return snap;
+        }
+        continue;
+      }
+      case Operation::MatchMatch:
+      case Operation::BreakMatch: {
+        if (hd == (int)input.size()) {
+          goto L_END;
+        }
+        if (ch != classes[(uint8_t)input[hd]]) {
+          if (op == Operation::BreakMatch) {
+            return snap;
+          }
+          pc += 2;
+          continue;
+        }
+        ++hd;
+        if (hd == (int)input.size()) {
+          pc += jump;  // the middle state is not final
+          goto L_END;
+        }
+        code = &prog[pc+1];
+        if (code->ops.ch != classes[(uint8_t)input[hd]]) {
+          return snap;  // the middle state's only edge is a Break
+        }
+        pc = pc + 1 + code->ops.jump;
+        ++hd;
+        if (stop(pc)) {
+          return snap;
+        }
         continue;
       }
       case Operation::Output:
-      case Operation::OutputBreak: {
-        if (hd == input.size()) {
+      case Operation::OutputBreak:
+      case Operation::OutputAccept:
+      case Operation::OutputAcceptBreak: {
+        if (hd == (int)input.size()) {
           goto L_END;
         }
-        if (ch != input[hd]) {
-          if (op == Operation::OutputBreak) {
+        if (ch != classes[(uint8_t)input[hd]]) {
+          if (op == Operation::OutputBreak || op == Operation::OutputAcceptBreak) {
             return snap;
           }
           if (jump == 0) {
             ++pc;
           }
           ++pc;
-          ++pc;
           continue;
         }
-        ++pc;
-        code = &prog[pc];
-        out = code->v32;
+        out = outputAt(pc);
         if (jump > 0) {
           pc += jump;
         } else {
@@ -357,25 +1215,33 @@ struct FST {
           pc += code->v32;
         }
         ++hd;
+        if (op == Operation::OutputAccept || op == Operation::OutputAcceptBreak) {
+          // the destination is a tail-less AcceptBreak
+          Configuration c(pc, hd);
+          c.out.push_back(out);
+          snap.push_back(move(c));
+          op = Operation::AcceptBreak;
+          goto L_END;
+        }
+        if (stop(pc)) {
+          return snap;
+        }
         continue;
       }
       case Operation::Accept:
       case Operation::AcceptBreak: {
         Configuration c(pc, hd);
-        ++pc;
         if (ch == 0) {
           c.out.push_back(out);
         } else {
-          code = &prog[pc];
-          auto to = code->v32;
-          ++pc;
-          code = &prog[pc];
-          auto from = code->v32;
+          int32_t from, to;
+          tailAt(pc, &from, &to);
           c.out.insert(c.out.end(), data.begin() + from, data.begin() + to);
-          ++pc;
         }
+        ++pc;
         snap.push_back(move(c));
-        if (op == Operation::AcceptBreak || hd == input.size()) {
+        if (op == Operation::AcceptBreak || hd == (int)input.size() ||
+            outOfReach(pc - 1, input.size() - hd)) {
           goto L_END;
         }
         continue;
@@ -386,7 +1252,7 @@ struct FST {
       }
     }      
   L_END:
-    if (hd != input.size()) {
+    if (hd != (int)input.size()) {
       return snap;
     }
     if (op != Operation::Accept && op != Operation::AcceptBreak) {
@@ -397,13 +1263,226 @@ struct FST {
   }
 
   // Search runs a finite state transducer for a given input and returns outputs if accepted otherwise nil.
-  vector<int32_t> Search(string input) {
-    bool accept;
-    auto snap = run(input, &accept);
-    if (!accept || snap.size() == 0) {
+  vector<int32_t> Search(const string &input) const {
+    int32_t out = 0;
+    int pc = lookup<true>(input, &out);
+    if (pc < 0) {
       return vector<int32_t>();
     }
-    return move(snap.back().out);
+    return outputsAt(pc, out);
+  }
+
+  // Search stores the outputs of input in outs, which can be any vector-like container
+  // (e.g. a std::pmr::vector on a per-request buffer), and reports whether input is a
+  // keyword.
+  template <typename Outs>
+  bool Search(const string &input, Outs *outs) const {
+    outs->clear();
+    int32_t out = 0;
+    int pc = lookup<true>(input, &out);
+    if (pc < 0) {
+      return false;
+    }
+    if (prog[pc].ops.ch == 0) {
+      outs->push_back(out);
+    } else {
+      int32_t from, to;
+      tailAt(pc, &from, &to);
+      outs->insert(outs->end(), data.begin() + from, data.begin() + to);
+    }
+    return true;
+  }
+
+  // SearchSorted looks up a batch of keys and calls visitor(i, outputs) for each
+  // keys[i], with empty outputs if it is not found. The walk of the previous key is kept
+  // as a stack of (pc, output) per depth and resumed at the longest common prefix, so a
+  // sorted batch costs about one merge-walk of the automaton. Unsorted keys give the same
+  // results with less reuse. Keys the prefilter rules out are answered without a walk
+  // and leave the stack as it was.
+  template <typename Visitor>
+  void SearchSorted(const vector<string> &keys, Visitor visitor) const {
+    vector<pair<int, int32_t>> stack;  // state reached after depth bytes of prev
+    if (runnable()) {
+      stack.push_back(make_pair(0, 0));
+    }
+    const string empty;
+    const string *prev = &empty;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      const auto &key = keys[i];
+      if (stack.empty() || (!prefilter.empty() && !prefilter.mayContain(key))) {
+        visitor(i, vector<int32_t>());
+        continue;
+      }
+      size_t depth = std::min(commonPrefixLen(key, *prev), stack.size() - 1);
+      stack.resize(depth + 1);
+      prev = &key;
+      int pc = stack.back().first;
+      int32_t out = stack.back().second;
+      for (; depth < key.size(); ++depth) {
+        pc = transition<true>(pc, (uint8_t)key[depth], &out);
+        if (pc < 0) {
+          break;
+        }
+        stack.push_back(make_pair(pc, out));
+      }
+      if (pc < 0 || (prog[pc].ops.op != Operation::Accept &&
+                     prog[pc].ops.op != Operation::AcceptBreak)) {
+        visitor(i, vector<int32_t>());
+        continue;
+      }
+      visitor(i, outputsAt(pc, out));
+    }
+  }
+
+  // Root returns a cursor at the initial state.
+  Cursor Root() const;
+
+  // Stats counts instructions, far jumps and sizes of the program.
+  ProgramStats Stats() const {
+    ProgramStats st;
+    for (size_t pc = 0; pc < prog.size(); ++pc) {
+      const auto &code = prog[pc];
+      ++st.instructions;
+      switch (code.ops.op) {
+      case Operation::Accept:
+      case Operation::AcceptBreak:
+        break;
+      default:
+        // the Break inlined after a MatchMatch is counted on the next turn
+        if (code.ops.jump == 0) {
+          ++st.farJumps;
+          ++pc;
+        }
+        break;
+      }
+    }
+    st.words = prog.size() + outs.size() + tailRanges.size();
+    st.prefilterBytes = prefilter.bytes();
+    st.bytes = (st.words + data.size()) * sizeof(int32_t) + classes.size() + st.prefilterBytes;
+    return st;
+  }
+
+  // Optimize rewrites the program in place: code of unreachable states is dropped,
+  // states with identical code are merged, states are laid out in depth-first order
+  // so that parents sit next to their children, and the shared Accept leaf is copied
+  // next to its far parents (Mast::splitLeaves), so that fewer jumps need 32 bits. The
+  // smallest of these layouts is kept, and the program is left as is if none is
+  // smaller.
+  OptimizeStats Optimize();
+
+  // Contains reports whether input is a keyword without decoding any outputs.
+  bool Contains(const string &input) const {
+    int32_t out;
+    return lookup<false>(input, &out) >= 0;
+  }
+
+  // CommonPrefixLengths stores the lengths of the keywords that are prefixes of input.
+  // No outputs are decoded, so this is the prefix query of an acceptor.
+  template <typename Lens>
+  void CommonPrefixLengths(const string &input, Lens *lens) const {
+    lens->clear();
+    prefixes<false>(input, [lens](int len, int, int32_t) {
+      lens->push_back(len);
+      return true;
+    });
+  }
+
+  // LongestPrefixLength returns the length of the longest keyword that is a prefix of
+  // input, or -1.
+  int LongestPrefixLength(const string &input) const {
+    int longest = -1;
+    prefixes<false>(input, [&longest](int len, int, int32_t) {
+      longest = len;
+      return true;
+    });
+    return longest;
+  }
+
+  // BuildDenseTable expands the program into dense, a state x byte class table for
+  // ContainsBatch. Returns false, leaving dense empty, if it would exceed maxBytes.
+  bool BuildDenseTable(size_t maxBytes = size_t(64) << 20) {
+    dense = DenseTable();
+    if (!runnable()) {
+      return false;
+    }
+    const size_t n = minBelow.size();  // states, numbered by stateIndex
+    const uint32_t width = 1 + *std::max_element(classes.begin(), classes.end());
+    const size_t cells = n * width;
+    if (cells * sizeof(int32_t) > maxBytes || 2 * cells > (size_t)INT32_MAX) {
+      return false;
+    }
+    auto cell = [this, width](int pc) {
+      auto op = prog[pc].ops.op;
+      bool isFinal = op == Operation::Accept || op == Operation::AcceptBreak;
+      return (int32_t)(stateIndex.rank(pc) * width * 2) | (isFinal ? 1 : 0);
+    };
+    dense.width = width;
+    dense.root = cell(0);
+    dense.cells.assign(cells, -1);
+    for (size_t pc = 0; pc < prog.size(); ++pc) {
+      if (!stateIndex.marked(pc)) {
+        continue;
+      }
+      const size_t row = stateIndex.rank(pc) * width;
+      forEachEdge((int)pc, [&](const Transition &t) {
+        dense.cells[row + t.ch] = cell(t.next);
+      });
+    }
+    return true;
+  }
+
+  // ContainsBatch sets (*found)[i] to whether keys[i] is a keyword. With a dense table
+  // the keys are walked 8 at a time in lockstep using AVX2 gathers (or one at a time
+  // through the table without AVX2); otherwise each key goes through Contains.
+  void ContainsBatch(const vector<string> &keys, vector<char> *found) const {
+    found->assign(keys.size(), 0);
+    if (dense.empty()) {
+      for (size_t i = 0; i < keys.size(); ++i) {
+        (*found)[i] = Contains(keys[i]);
+      }
+      return;
+    }
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i minusOne = _mm256_set1_epi32(-1);
+    for (; i + 8 <= keys.size(); i += 8) {
+      alignas(32) int32_t len[8];
+      size_t maxLen = 0;
+      for (int k = 0; k < 8; ++k) {
+        len[k] = (int32_t)keys[i+k].size();
+        maxLen = std::max(maxLen, keys[i+k].size());
+      }
+      const __m256i lens = _mm256_load_si256(reinterpret_cast<const __m256i *>(len));
+      __m256i v = _mm256_set1_epi32(dense.root);
+      for (size_t d = 0; d < maxLen; ++d) {
+        alignas(32) int32_t cls[8];
+        for (int k = 0; k < 8; ++k) {
+          cls[k] = (int32_t)d < len[k] ? classes[(uint8_t)keys[i+k][d]] : 0;
+        }
+        // lanes with input left that have not failed
+        __m256i active = _mm256_and_si256(_mm256_cmpgt_epi32(lens, _mm256_set1_epi32((int32_t)d)),
+                                          _mm256_cmpgt_epi32(v, minusOne));
+        if (_mm256_testz_si256(active, active)) {
+          break;
+        }
+        __m256i idx = _mm256_add_epi32(_mm256_srli_epi32(v, 1),
+                                       _mm256_load_si256(reinterpret_cast<const __m256i *>(cls)));
+        v = _mm256_mask_i32gather_epi32(v, dense.cells.data(), idx, active, 4);
+      }
+      alignas(32) int32_t res[8];
+      _mm256_store_si256(reinterpret_cast<__m256i *>(res), v);
+      for (int k = 0; k < 8; ++k) {
+        (*found)[i+k] = res[k] >= 0 && (res[k] & 1);
+      }
+    }
+#endif
+    for (; i < keys.size(); ++i) {
+      int32_t v = dense.root;
+      for (size_t d = 0; d < keys[i].size() && v >= 0; ++d) {
+        v = dense.cells[(v >> 1) + classes[(uint8_t)keys[i][d]]];
+      }
+      (*found)[i] = v >= 0 && (v & 1);
+    }
   }
 
   // PrefixSearch returns the longest commom prefix keyword and it's length in given input
@@ -437,17 +1516,401 @@ struct FST {
     return outputs;
   }
 
+  // Lattice finds the keywords starting at every byte offset of sentence, as
+  // CommonPrefixSearch would at each offset; the outputs of a hit are outs[from, to).
+  // hits and outs may be any vector-like containers, e.g. std::pmr::vectors.
+  template <typename Hits, typename Outs>
+  void Lattice(const string &sentence, Hits *hits, Outs *outs) const {
+    hits->clear();
+    outs->clear();
+    for (size_t begin = 0; begin < sentence.size(); ++begin) {
+      prefixes<true>(sentence, [&](int len, int pc, int32_t out) {
+        if (len > 0) {
+          auto from = (uint32_t)outs->size();
+          if (prog[pc].ops.ch == 0) {
+            outs->push_back(out);
+          } else {
+            int32_t a, b;
+            tailAt(pc, &a, &b);
+            outs->insert(outs->end(), data.begin() + a, data.begin() + b);
+          }
+          hits->push_back(LatticeHit{(uint32_t)begin, (uint32_t)len, from, (uint32_t)outs->size()});
+        }
+        return true;
+      }, begin);
+    }
+  }
+
   // Write saves a program of finite state transducer (virtual machine)
   bool Write(ostream *w) {
     ios::sync_with_stdio(false);
+    writeHeader(w);
+    if (acceptor) {
+      return writeProg(w);
+    }
     size_t dataLen = data.size();
     WriteUint(w, dataLen);
     for (auto &v : data) {
       WriteUint(w, static_cast<uint32_t>(v));
     }
+    WriteUint(w, outs.size());
+    for (auto &v : outs) {
+      WriteUint(w, static_cast<uint32_t>(v));
+    }
+    WriteUint(w, tailRanges.size());
+    for (auto &v : tailRanges) {
+      WriteUint(w, static_cast<uint32_t>(v));
+    }
+    return writeProg(w);
+  }
+
+  // Read loads a program of finite state transducer (virtual machine)
+  // Images that fail Verify are rejected, so a loaded program is as safe to run
+  // unchecked as one from buildMachine.
+  bool Read(istream *r) {
+    ios::sync_with_stdio(false);
+    *this = FST();
+    auto flags = ReadUint<uint8_t>(r);
+    acceptor = (flags & imageAcceptor) != 0;
+    for (auto &c : classes) {
+      c = ReadUint<uint8_t>(r);
+    }
+    if (flags & imagePrefilter) {
+      prefilter.k = ReadUint<uint8_t>(r);
+      size_t len = ReadUint<size_t>(r);
+      prefilter.words.reserve(len < maxReserve ? len : maxReserve);
+      for (size_t i = 0; i < len && *r; ++i) {
+        prefilter.words.push_back(ReadUint<uint64_t>(r));
+      }
+      if (!*r || prefilter.k == 0 || prefilter.k > 16 || len == 0 || len % 8 != 0) {
+        cerr << "invalid format: bad prefilter" << endl;
+        *this = FST();
+        return false;
+      }
+    }
+    if (!acceptor && !(readInts(r, &data) && readInts(r, &outs) && readInts(r, &tailRanges))) {
+      cerr << "invalid format: truncated image" << endl;
+      *this = FST();
+      return false;
+    }
+    if (!readProg(r)) {
+      *this = FST();
+      return false;
+    }
+    string err;
+    if (!index(&err)) {
+      cerr << "invalid format: " << err << endl;
+      *this = FST();
+      return false;
+    }
+    return true;
+  }
+
+  // Verify checks that the program can run without bounds checks: every instruction is
+  // well formed, jumps go forward to an instruction inside prog, the operand and tail
+  // tables match the instructions and stay within data, and the last instruction ends a
+  // state so no edge scan runs off the end. The states reachable from pc 0 are then
+  // walked like annotate does: each is an optional Accept or AcceptBreak and then edges
+  // up to a Break, with no Accept among them, so every pc run steps to is a state start
+  // annotate marks. Since every jump goes forward, any walk terminates. Only memory
+  // safety is proven, not that the program is a minimal MAST.
+  bool Verify(string *err) const {
+    auto fail = [err](const char *msg, size_t pc) {
+      stringstream ss;
+      ss << msg << " at pc " << pc;
+      *err = ss.str();
+      return false;
+    };
+    const size_t n = prog.size();
+    vector<char> start(n, 0);
+    vector<pair<size_t, int64_t>> jumps;  // (pc, target)
+    size_t outputs = 0, tails = 0;
+    size_t last = 0;
+    for (size_t pc = 0; pc < n; ++pc) {
+      start[pc] = 1;
+      last = pc;
+      const auto &code = prog[pc];
+      switch (code.ops.op) {
+      case Operation::Accept:
+      case Operation::AcceptBreak:
+        if (code.ops.ch > 1) {
+          return fail("bad tail flag", pc);
+        }
+        tails += code.ops.ch;
+        break;
+      case Operation::MatchMatch:
+      case Operation::BreakMatch: {
+        // the middle state follows: a short, output-free Break checked as the next word
+        const auto &mid = prog[std::min(pc + 1, n - 1)];
+        if (pc + 1 >= n || code.ops.jump != 1 || mid.ops.op != Operation::Break ||
+            mid.ops.jump == 0) {
+          return fail("bad fused instruction", pc);
+        }
+        break;
+      }
+      case Operation::Match:
+      case Operation::Break:
+      case Operation::Output:
+      case Operation::OutputBreak:
+      case Operation::OutputAccept:
+      case Operation::OutputAcceptBreak:
+        outputs += isOutput(code.ops.op);
+        if (code.ops.jump > 0) {
+          jumps.push_back(make_pair(pc, (int64_t)pc + code.ops.jump));
+        } else if (pc + 1 < n) {
+          jumps.push_back(make_pair(pc, (int64_t)pc + 1 + prog[pc+1].v32));
+          ++pc;
+        } else {
+          return fail("missing far jump", pc);
+        }
+        break;
+      default:
+        return fail("undefined operation", pc);
+      }
+    }
+    for (const auto &j : jumps) {
+      if (j.second <= (int64_t)j.first || j.second >= (int64_t)n || !start[j.second]) {
+        return fail("bad jump", j.first);
+      }
+      auto op = prog[j.first].ops.op;
+      if ((op == Operation::OutputAccept || op == Operation::OutputAcceptBreak) &&
+          (prog[j.second].ops.op != Operation::AcceptBreak || prog[j.second].ops.ch != 0)) {
+        return fail("OutputAccept to a state with edges or tails", j.first);
+      }
+    }
+    if (n > 0) {
+      auto op = prog[last].ops.op;
+      if (op != Operation::Break && op != Operation::OutputBreak &&
+          op != Operation::OutputAcceptBreak && op != Operation::AcceptBreak) {
+        return fail("program does not end a state", last);
+      }
+    }
+    if (outputs != outs.size() || 2 * tails != tailRanges.size() ||
+        (acceptor && (outputs != 0 || tails != 0))) {
+      return fail("operand tables do not match the program", n);
+    }
+    for (size_t i = 0; i < tailRanges.size(); i += 2) {
+      if (tailRanges[i] < 0 || tailRanges[i] > tailRanges[i+1] ||
+          tailRanges[i+1] > (int32_t)data.size()) {
+        return fail("tail range out of data", i / 2);
+      }
+    }
+
+    // the jumps are checked above, so the walk only checks the layout of each state
+    vector<char> state(n, 0);
+    if (n > 0) {
+      state[0] = 1;
+    }
+    for (size_t pc = 0; pc < n; ++pc) {
+      if (!state[pc] || prog[pc].ops.op == Operation::AcceptBreak) {
+        continue;
+      }
+      size_t at = prog[pc].ops.op == Operation::Accept ? pc + 1 : pc;
+      for (bool last = false; !last;) {
+        if (at >= n) {
+          return fail("state runs off the end", pc);
+        }
+        const auto &code = prog[at];
+        const auto op = code.ops.op;
+        if (op == Operation::Accept || op == Operation::AcceptBreak) {
+          return fail("Accept inside a state", at);
+        }
+        last = op == Operation::Break || op == Operation::BreakMatch ||
+               op == Operation::OutputBreak || op == Operation::OutputAcceptBreak;
+        if (op == Operation::MatchMatch || op == Operation::BreakMatch) {
+          state[at + 1] = 1;  // the middle state
+          at += 2;
+        } else if (code.ops.jump > 0) {
+          state[at + code.ops.jump] = 1;
+          at += 1;
+        } else {
+          state[at + 1 + prog[at+1].v32] = 1;
+          at += 2;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Export streams the neighbourhood of opts.key (or the first opts.depth levels) as
+  // Graphviz DOT or JSON. States are identified by the pc of their code, which is stable
+  // for a given image. Returns the number of exported states.
+  size_t Export(ostream &w, const ExportOptions &opts = ExportOptions()) const {
+    const bool json = opts.format == ExportOptions::Format::Json;
+    // one state past maxStates is kept to tell that the export was truncated
+    vector<pair<int, size_t>> queue;  // (pc, level)
+    unordered_set<int> seen;
+    auto push = [&](int pc, size_t level) {
+      if (queue.size() <= opts.maxStates && seen.insert(pc).second) {
+        queue.push_back(make_pair(pc, level));
+      }
+    };
+    if (runnable()) {
+      int pc = 0;
+      push(pc, 0);
+      for (auto c : opts.key) {
+        pc = step(pc, (uint8_t)c);
+        if (pc < 0) {
+          break;
+        }
+        push(pc, 0);
+      }
+    }
+
+    // the caller's number formatting is restored on return
+    struct FormatGuard {
+      ostream &w;
+      ios::fmtflags flags;
+      ~FormatGuard() { w.flags(flags); }
+    } guard{w, w.flags()};
+    w << dec;
+    if (json) {
+      w << "{\"states\":[";
+    } else {
+      w << "digraph G {" << endl;
+      w << "\trankdir=LR;" << endl;
+      w << "\tnode [shape=circle];" << endl;
+    }
+    size_t count = 0;
+    bool truncated = false;
+    for (size_t i = 0; i < queue.size(); ++i) {
+      if (count == opts.maxStates) {
+        truncated = true;
+        break;
+      }
+      const int pc = queue[i].first;
+      const size_t level = queue[i].second;
+      const auto s = decodeState(pc);
+      if (json) {
+        w << (count ? "," : "") << "{\"id\":" << pc
+          << ",\"final\":" << (s.isFinal ? "true" : "false");
+        if (s.tailFrom >= 0) {
+          w << ",\"tails\":[";
+          for (int t = s.tailFrom; t < s.tailTo; ++t) {
+            w << (t > s.tailFrom ? "," : "") << data[t];
+          }
+          w << "]";
+        }
+        w << ",\"edges\":[";
+      } else if (s.isFinal) {
+        w << "\t" << pc << " [peripheries=2";
+        if (s.tailFrom >= 0) {
+          w << ", xlabel=\"";
+          for (int t = s.tailFrom; t < s.tailTo; ++t) {
+            w << (t > s.tailFrom ? "," : "") << data[t];
+          }
+          w << "\"";
+        }
+        w << "];" << endl;
+      }
+      bool firstEdge = true;
+      for (const auto &t : s.edges) {
+        forEachByte(t.ch, [&](uint8_t b) {
+          if (json) {
+            w << (firstEdge ? "" : ",") << "{\"label\":" << (int)b
+              << ",\"out\":" << t.out << ",\"to\":" << t.next << "}";
+          } else {
+            char label[3];
+            snprintf(label, sizeof(label), "%02X", b);
+            w << "\t" << pc << " -> " << t.next << " [label=\"" << label;
+            if (t.out != 0) {
+              w << "/" << t.out;
+            }
+            w << "\"];" << endl;
+          }
+          firstEdge = false;
+        });
+        if (level < opts.depth) {
+          push(t.next, level + 1);
+        }
+      }
+      if (json) {
+        w << "]}";
+      }
+      ++count;
+    }
+    if (json) {
+      w << "],\"truncated\":" << (truncated ? "true" : "false") << "}" << endl;
+    } else {
+      if (truncated) {
+        w << "\t// truncated at " << opts.maxStates << " states" << endl;
+      }
+      w << "}" << endl;
+    }
+    return count;
+  }
+
+  // Warmup pretouches the program and data pages and replays a sample of lookups so
+  // that the first queries after Read don't pay for page faults and cold caches.
+  // Returns false if some of the requested memory advice could not be applied.
+  bool Warmup(const WarmupOptions &opts = WarmupOptions()) {
+    bool ok = true;
+    ok &= touchPages(prog.data(), prog.size() * sizeof(Instruction), opts.willNeed);
+    ok &= touchPages(data.data(), data.size() * sizeof(int32_t), opts.willNeed);
+    ok &= touchPages(outs.data(), outs.size() * sizeof(int32_t), opts.willNeed);
+    ok &= touchPages(tailRanges.data(), tailRanges.size() * sizeof(int32_t), opts.willNeed);
+    if (opts.lockProgram) {
+      ok &= programLock.lock(prog.data(), prog.size() * sizeof(Instruction));
+    }
+
+    vector<string> sampled;
+    const vector<string> *profile = opts.profile;
+    if (profile == nullptr) {
+      sampled = sampleKeys(opts.samples);
+      profile = &sampled;
+    }
+    size_t n = std::min(opts.samples, profile->size());
+    volatile size_t sink = 0;
+    for (size_t i = 0; i < n; ++i) {
+      sink += Search((*profile)[i]).size();
+    }
+    (void)sink;
+    return ok;
+  }
+
+  // WarmupAsync runs Warmup in the background; the service should wait for the
+  // returned future before reporting ready. The task uses this FST (and opts.profile)
+  // in place: both must outlive the future and must not be modified until it is ready.
+  // The future's destructor waits for the task.
+  std::future<bool> WarmupAsync(WarmupOptions opts = WarmupOptions()) {
+    return std::async(std::launch::async, [this, opts]() { return Warmup(opts); });
+  }
+
+  // Unlock undoes WarmupOptions::lockProgram.
+  void Unlock() { programLock.release(); }
+
+ private:
+  static constexpr uint8_t imageAcceptor = 1;  // image flag: no data, outs or tails
+  static constexpr uint8_t imagePrefilter = 2;  // image flag: a BloomFilter follows classes
+  static constexpr size_t maxReserve = 1 << 20;  // elements reserved ahead of a read
+
+  friend struct Mast;  // streams images through writeHeader and writeCode
+
+  // writeHeader writes the flags, the classes and the prefilter.
+  void writeHeader(ostream *w) const {
+    WriteUint(w, static_cast<uint8_t>((acceptor ? imageAcceptor : 0) |
+                                      (prefilter.empty() ? 0 : imagePrefilter)));
+    for (auto c : classes) {
+      WriteUint(w, c);
+    }
+    if (!prefilter.empty()) {
+      WriteUint(w, prefilter.k);
+      WriteUint(w, prefilter.words.size());
+      for (auto v : prefilter.words) {
+        WriteUint(w, v);
+      }
+    }
+  }
+
+  bool writeProg(ostream *w) const {
     size_t progLen = prog.size();
     WriteUint(w, progLen);
-    for (size_t pc = 0; pc < prog.size(); ++pc) {
+    return writeCode(w, prog.data(), prog.size());
+  }
+
+  // writeCode writes the n words of whole instructions at prog.
+  static bool writeCode(ostream *w, const Instruction *prog, size_t n) {
+    for (size_t pc = 0; pc < n; ++pc) {
       auto code = &prog[pc];
       auto &op = code->ops.op;
       auto &ch = code->ops.ch;
@@ -460,21 +1923,14 @@ struct FST {
       switch (op) {
       case Operation::Accept:
       case Operation::AcceptBreak: {
-        if (ch == 0) {
-          break;
-        }
-        ++pc;
-        code = &prog[pc];
-        auto &to = code->v32;
-        WriteUint(w, static_cast<uint32_t>(to));
-        ++pc;
-        code = &prog[pc];
-        auto &from = code->v32;
-        WriteUint(w, static_cast<uint32_t>(from));
         break;
       }
       case Operation::Match:
-      case Operation::Break: {
+      case Operation::Break:
+      case Operation::Output:
+      case Operation::OutputBreak:
+      case Operation::OutputAccept:
+      case Operation::OutputAcceptBreak: {
         WriteUint(w, static_cast<uint16_t>(jump));
         if (jump != 0) {
           break;
@@ -484,19 +1940,13 @@ struct FST {
         WriteUint(w, static_cast<uint32_t>(code->v32));
         break;
       }
-      case Operation::Output:
-      case Operation::OutputBreak: {
+      case Operation::MatchMatch:
+      case Operation::BreakMatch: {
         WriteUint(w, static_cast<uint16_t>(jump));
         ++pc;
         code = &prog[pc];
         WriteUint(w, static_cast<uint32_t>(code->v32));
-        
-        if (jump != 0) {
-          break;
-        }
-        ++pc;
-        code = &prog[pc];
-        WriteUint(w, static_cast<uint32_t>(code->v32));
+        break;
       }
       default: {
         cerr << "undefined operation error" << endl;
@@ -507,18 +1957,21 @@ struct FST {
     return true;
   }
 
-  // Read loads a program of finite state transducer (virtual machine)
-  bool Read(istream *r) {
-    ios::sync_with_stdio(false);
-    size_t dataLen = ReadUint<size_t>(r);
-    data.reserve(dataLen);
-    for (size_t i = 0; i < dataLen; ++i) {
-      data.push_back(ReadUint<uint32_t>(r));
+  // readInts reads a length-prefixed table; lengths are not trusted for reserving.
+  static bool readInts(istream *r, vector<int32_t> *v) {
+    size_t len = ReadUint<size_t>(r);
+    v->reserve(len < maxReserve ? len : maxReserve);
+    for (size_t i = 0; i < len && *r; ++i) {
+      v->push_back(ReadUint<uint32_t>(r));
     }
+    return !r->fail();
+  }
+
+  bool readProg(istream *r) {
     size_t progLen = ReadUint<size_t>(r);
-    prog.reserve(progLen);
+    prog.reserve(progLen < maxReserve ? progLen : maxReserve);
     Instruction code;
-    for (size_t pc = 0; pc < progLen; ++pc) {
+    while (prog.size() < progLen && *r) {
       Operation op = static_cast<Operation>(ReadUint<uint8_t>(r));
       uint8_t ch = ReadUint<uint8_t>(r);
 
@@ -529,17 +1982,14 @@ struct FST {
         code.ops.ch = ch;
         code.ops.jump = 0;
         prog.push_back(code);
-        if (ch == 0) {
-          break;
-        }
-        code.v32 = static_cast<int32_t>(ReadUint<uint32_t>(r));
-        prog.push_back(code);
-        code.v32 = static_cast<int32_t>(ReadUint<uint32_t>(r));
-        prog.push_back(code);
         break;
       }
       case Operation::Match:
-      case Operation::Break: {
+      case Operation::Break:
+      case Operation::Output:
+      case Operation::OutputBreak:
+      case Operation::OutputAccept:
+      case Operation::OutputAcceptBreak: {
         code.ops.op = op;
         code.ops.ch = ch;
         code.ops.jump = ReadUint<uint16_t>(r);
@@ -552,19 +2002,12 @@ struct FST {
         prog.push_back(code);
         break;
       }
-      case Operation::Output:
-      case Operation::OutputBreak: {
+      case Operation::MatchMatch:
+      case Operation::BreakMatch: {
         code.ops.op = op;
         code.ops.ch = ch;
-        uint16_t jump = ReadUint<uint16_t>(r);
-        code.ops.jump = jump;
-        prog.push_back(code);
-        code.v32 = static_cast<int32_t>(ReadUint<uint32_t>(r));
+        code.ops.jump = ReadUint<uint16_t>(r);
         prog.push_back(code);
-        
-        if (jump != 0) {
-          break;
-        }
         code.v32 = static_cast<int32_t>(ReadUint<uint32_t>(r));
         prog.push_back(code);
         break;
@@ -575,200 +2018,2276 @@ struct FST {
       }
       }
     }
+    if (r->fail()) {
+      cerr << "invalid format: truncated image" << endl;
+      return false;
+    }
     return true;
   }
 
+  static bool touchPages(const void *addr, size_t len, bool willNeed) {
+    if (len == 0) {
+      return true;
+    }
+    bool ok = true;
+#if defined(__unix__) || defined(__APPLE__)
+    const uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)addr & ~(pageSize - 1);
+    size_t alignedLen = (uintptr_t)addr + len - begin;
+    if (willNeed && madvise((void *)begin, alignedLen, MADV_WILLNEED) != 0) {
+      ok = false;
+    }
+#else
+    const uintptr_t pageSize = 4096;
+    (void)willNeed;
+#endif
+    const volatile char *p = static_cast<const volatile char *>(addr);
+    char sink = 0;
+    for (size_t off = 0; off < len; off += pageSize) {
+      sink ^= p[off];
+    }
+    (void)sink;
+    return ok;
+  }
 };
 
-// mast represents a Minimal Acyclic Subsequential Transeducer.
-struct Mast {
-  shared_ptr<State> initialState;
-  vector<shared_ptr<State>> states;
-  vector<shared_ptr<State>> finalStates;
+// OutputSpan is a view of the outputs of an accepting cursor.
+struct OutputSpan {
+  const int32_t *first = nullptr;
+  const int32_t *last = nullptr;
 
-  void addState(shared_ptr<State> n) {
-    n->id = states.size();
-    states.push_back(n);
-    if (n->isFinal) {
-      finalStates.push_back(n);
-    }
+  const int32_t *begin() const { return first; }
+  const int32_t *end() const { return last; }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+  int32_t operator[](size_t i) const { return first[i]; }
+};
+
+// Cursor is a copyable position in a compiled FST for incremental and custom
+// traversals. Stepping costs one transition and never allocates.
+struct Cursor {
+  const FST *fst = nullptr;
+  int pc = -1;  // start of the current state's code, -1 if invalid
+  int32_t out = 0;  // last edge output on the path
+
+  bool Valid() const {
+    return pc >= 0;
   }
 
-  vector<int32_t> run(const string &input, bool* ok) {
-    auto s = initialState;
-    vector<int32_t> out;
-    for (size_t i = 0; i < input.length(); ++i) {
-      auto o = s->output.find((uint8_t)input[i]);
-      if (o != s->output.end()) {
-        out.push_back(o->second);
-      }
-      auto it = s->trans.find((uint8_t)input[i]);
-      if (it != s->trans.end()) {
-        s = it->second;
-      } else {
-        *ok = false;
-        return out;
-      }
+  // Step follows the edge labeled ch; the cursor is left unchanged on failure.
+  bool Step(uint8_t ch) {
+    if (!Valid()) {
+      return false;
     }
-    for (auto t : s->getTails()) {
-      out.push_back(t);
+    int32_t o = out;
+    int next = fst->transition<true>(pc, ch, &o);
+    if (next < 0) {
+      return false;
     }
-    return out;
+    pc = next;
+    out = o;
+    return true;
   }
 
-  bool accept(const string &input) {
-    auto s = initialState;
-    for (size_t i = 0; i < input.length(); ++i) {
-      auto it = s->trans.find((uint8_t)input[i]);
-      if (it != s->trans.end()) {
-        s = it->second;
-      } else {
-        return false;
-      }
+  bool IsFinal() const {
+    if (!Valid()) {
+      return false;
+    }
+    auto op = fst->prog[pc].ops.op;
+    return op == Operation::Accept || op == Operation::AcceptBreak;
+  }
+
+  // Outputs returns the outputs of a final state; the span points into the FST's data
+  // or into this cursor, so it is valid while both are.
+  OutputSpan Outputs() const {
+    OutputSpan span;
+    if (!IsFinal()) {
+      return span;
+    }
+    const auto &code = fst->prog[pc];
+    if (code.ops.ch == 0) {
+      span.first = &out;
+      span.last = &out + 1;
+    } else {
+      int32_t from, to;
+      fst->tailAt(pc, &from, &to);
+      span.first = fst->data.data() + from;
+      span.last = fst->data.data() + to;
+    }
+    return span;
+  }
+
+  // ForEachChild calls f(ch, child) for each outgoing byte in increasing order.
+  // Bytes of one class share an edge. When the edges' classes span disjoint, increasing
+  // byte ranges, as they always do with singleton classes, the children are visited
+  // straight off the program; otherwise the bytes are walked in order and looked up by
+  // class.
+  template <typename F>
+  void ForEachChild(F f) const {
+    if (!Valid()) {
+      return;
+    }
+    int last = -1;
+    bool ordered = true;
+    fst->forEachEdge(pc, [this, &last, &ordered](const Transition &t) {
+      const auto from = fst->classFirst[t.ch];
+      const auto to = fst->classFirst[t.ch+1];
+      if (from < to) {
+        ordered = ordered && fst->classMembers[from] > last;
+        last = fst->classMembers[to-1];
+      }
+    });
+    if (ordered) {
+      fst->forEachEdge(pc, [this, &f](const Transition &t) {
+        const Cursor c = child(t.next, t.out);
+        fst->forEachByte(t.ch, [&](uint8_t b) { f(b, c); });
+      });
+      return;
+    }
+    uint64_t present[4] = {0, 0, 0, 0};
+    int next[256];
+    int32_t outs[256];
+    fst->forEachEdge(pc, [&present, &next, &outs](const Transition &t) {
+      present[t.ch / 64] |= uint64_t(1) << (t.ch % 64);
+      next[t.ch] = t.next;
+      outs[t.ch] = t.out;
+    });
+    for (int b = 0; b < 256; ++b) {
+      const uint8_t c = fst->classes[b];
+      if (present[c / 64] >> (c % 64) & 1) {
+        f((uint8_t)b, child(next[c], outs[c]));
+      }
+    }
+  }
+
+ private:
+  Cursor child(int next, int32_t o) const {
+    Cursor c = *this;
+    c.pc = next;
+    if (o != 0) {
+      c.out = o;
+    }
+    return c;
+  }
+};
+
+inline Cursor FST::Root() const {
+  Cursor c;
+  c.fst = this;
+  c.pc = runnable() ? 0 : -1;
+  return c;
+}
+
+// SentenceCacheStats counts the work of a SentenceCache.
+struct SentenceCacheStats {
+  size_t lookups = 0;
+  size_t hits = 0;
+  size_t entries = 0;  // sentences held, each counted once
+  size_t bytes = 0;  // arena and index bytes of the entries held
+  size_t evictions = 0;  // sentences dropped to stay within the budget
+
+  double hitRate() const {
+    return lookups == 0 ? 0 : (double)hits / lookups;
+  }
+};
+
+// SentenceCache memoizes FST::Lattice for text that repeats whole sentences
+// (boilerplate, headers, titles), which are then answered without running the program.
+// An entry is found by a hash of the sentence and packs the sentence, its hits and
+// their outputs into an arena. The byte budget is split between two generations:
+// when the newer one fills up the older one is dropped, and sentences found in the
+// older one are copied forward first, so the ones still in use survive.
+// A cache belongs to one FST and one thread.
+struct SentenceCache {
+  explicit SentenceCache(size_t budget = size_t(64) << 20) : budget(budget) {}
+
+  // Lattice is FST::Lattice through the cache.
+  void Lattice(const FST &fst, const string &sentence, vector<LatticeHit> *hits,
+               vector<int32_t> *outs) {
+    ++stats.lookups;
+    const auto h = BloomFilter::hash(sentence);
+    auto it = find(cur, h, sentence);
+    if (it != cur.index.end()) {
+      ++stats.hits;
+      read(cur, it->second, hits, outs);
+      return;
+    }
+    it = find(old, h, sentence);
+    if (it != old.index.end()) {
+      ++stats.hits;
+      read(old, it->second, hits, outs);
+      old.dead += words(&old.arena[it->second]);
+      old.index.erase(it);  // it moves to cur
+    } else {
+      fst.Lattice(sentence, hits, outs);
+    }
+    insert(h, sentence, *hits, *outs);
+  }
+
+  SentenceCacheStats Stats() const {
+    auto st = stats;
+    st.entries = cur.index.size() + old.index.size();
+    st.bytes = cur.bytes() + old.bytes();
+    return st;
+  }
+
+  void Clear() {
+    cur = Generation();
+    old = Generation();
+  }
+
+ private:
+  static constexpr size_t indexEntryBytes = 32;  // rough cost of a hash map node
+
+  // An entry is the sentence length, the hit and output counts, the hits (4 words
+  // each), the outputs and the sentence bytes padded to a word. Sentences whose
+  // hashes collide get an index node each.
+  struct Generation {
+    unordered_multimap<uint64_t, size_t> index;  // hash -> entry offset in arena
+    vector<uint32_t> arena;
+    size_t dead = 0;  // arena words of the entries copied forward
+
+    size_t bytes() const {
+      return (arena.size() - dead) * sizeof(uint32_t) + index.size() * indexEntryBytes;
+    }
+  };
+
+  size_t budget;
+  Generation cur, old;
+  SentenceCacheStats stats;
+
+  static size_t words(const uint32_t *e) {
+    return 3 + 4 * e[1] + e[2] + (e[0] + 3) / 4;
+  }
+
+  static unordered_multimap<uint64_t, size_t>::const_iterator find(
+      const Generation &g, uint64_t h, const string &sentence) {
+    const auto range = g.index.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+      const uint32_t *e = &g.arena[it->second];
+      if (e[0] == sentence.size() &&
+          memcmp(e + 3 + 4 * e[1] + e[2], sentence.data(), sentence.size()) == 0) {
+        return it;
+      }
+    }
+    return g.index.end();
+  }
+
+  static void read(const Generation &g, size_t at, vector<LatticeHit> *hits,
+                   vector<int32_t> *outs) {
+    const uint32_t *e = &g.arena[at];
+    const uint32_t nh = e[1], no = e[2];
+    hits->resize(nh);
+    for (uint32_t i = 0; i < nh; ++i) {
+      const uint32_t *w = e + 3 + 4 * i;
+      (*hits)[i] = LatticeHit{w[0], w[1], w[2], w[3]};
+    }
+    outs->resize(no);
+    for (uint32_t i = 0; i < no; ++i) {
+      (*outs)[i] = (int32_t)e[3 + 4 * nh + i];
+    }
+  }
+
+  void insert(uint64_t h, const string &sentence, const vector<LatticeHit> &hits,
+              const vector<int32_t> &outs) {
+    const size_t words = 3 + 4 * hits.size() + outs.size() + (sentence.size() + 3) / 4;
+    const size_t need = words * sizeof(uint32_t) + indexEntryBytes;
+    if (need > budget / 2 || sentence.size() > UINT32_MAX) {
+      return;
+    }
+    if (cur.bytes() + need > budget / 2) {
+      stats.evictions += old.index.size();  // the ones not copied forward
+      old = move(cur);
+      cur = Generation();
+    }
+    const size_t at = cur.arena.size();
+    cur.arena.resize(at + words, 0);
+    uint32_t *e = &cur.arena[at];
+    e[0] = (uint32_t)sentence.size();
+    e[1] = (uint32_t)hits.size();
+    e[2] = (uint32_t)outs.size();
+    for (size_t i = 0; i < hits.size(); ++i) {
+      uint32_t *w = e + 3 + 4 * i;
+      w[0] = hits[i].begin;
+      w[1] = hits[i].len;
+      w[2] = hits[i].from;
+      w[3] = hits[i].to;
+    }
+    for (size_t i = 0; i < outs.size(); ++i) {
+      e[3 + 4 * hits.size() + i] = (uint32_t)outs[i];
+    }
+    memcpy(e + 3 + 4 * hits.size() + outs.size(), sentence.data(), sentence.size());
+    cur.index.emplace(h, at);
+  }
+};
+
+// PipelineOptions configures LatticeLines.
+struct PipelineOptions {
+  unsigned threads = 0;  // 0 uses the hardware concurrency
+  size_t chunkBytes = 256 << 10;  // lines are handed out in chunks of about this size
+  size_t cacheBytes = 0;  // budget of a SentenceCache per thread, 0 for none
+};
+
+// PipelineStats reports a LatticeLines run.
+struct PipelineStats {
+  unsigned threads = 0;
+  size_t bytes = 0;
+  size_t lines = 0;
+  size_t chunks = 0;
+  size_t hits = 0;  // lattice hits over all lines
+  double seconds = 0;
+
+  double mbPerSecond() const {
+    return seconds > 0 ? bytes / 1e6 / seconds : 0;
+  }
+};
+
+// HitSpan is a range of the lattice hits held by LatticeLines.
+struct HitSpan {
+  const LatticeHit *first = nullptr;
+  const LatticeHit *last = nullptr;
+
+  const LatticeHit *begin() const { return first; }
+  const LatticeHit *end() const { return last; }
+  size_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+  const LatticeHit &operator[](size_t i) const { return first[i]; }
+};
+
+// LatticeLines computes the lattice of every line of text ('\n' separated) on a pool
+// of threads sharing fst, each with its own scratch and cache. visit(lineNo, line,
+// hits, outs) is called on the calling thread for the lines in order with the HitSpan
+// and OutputSpan FST::Lattice would fill; they are valid during the call. Workers take
+// whole chunks of lines and stay at most a few chunks ahead of the visitor, which
+// bounds the results held. An exception from visit or a worker stops the workers and
+// is rethrown once they have been joined.
+template <typename Visitor>
+PipelineStats LatticeLines(const FST &fst, const string &text, Visitor visit,
+                           const PipelineOptions &opts = PipelineOptions()) {
+  const auto started = std::chrono::steady_clock::now();
+  PipelineStats stats;
+  stats.threads = opts.threads != 0 ? opts.threads : std::max(1u, std::thread::hardware_concurrency());
+  stats.bytes = text.size();
+
+  // chunks end after a newline, or at the end of text
+  vector<size_t> bounds(1, 0);
+  const size_t chunk = opts.chunkBytes > 0 ? opts.chunkBytes : 1;
+  while (bounds.back() < text.size()) {
+    size_t at = std::min(bounds.back() + chunk, text.size()) - 1;
+    at += findByte(text.data() + at, text.size() - at, '\n');
+    bounds.push_back(std::min(at + 1, text.size()));
+  }
+  stats.chunks = bounds.size() - 1;
+
+  struct Line {
+    size_t begin, len;
+    size_t hitFrom, hitTo;  // into hits
+    size_t outFrom, outTo;  // into outs
+  };
+  struct Result {
+    vector<Line> lines;
+    vector<LatticeHit> hits;  // as FST::Lattice returns them for the line
+    vector<int32_t> outs;
+    bool done = false;
+  };
+  vector<Result> results(stats.chunks);
+  auto tokenize = [&](size_t c, SentenceCache *cache, string *line, vector<LatticeHit> *hits,
+                      vector<int32_t> *outs) {
+    auto &r = results[c];
+    for (size_t at = bounds[c]; at < bounds[c+1];) {
+      size_t len = findByte(text.data() + at, bounds[c+1] - at, '\n');
+      line->assign(text, at, len);
+      if (cache) {
+        cache->Lattice(fst, *line, hits, outs);
+      } else {
+        fst.Lattice(*line, hits, outs);
+      }
+      r.lines.push_back(Line{at, len, r.hits.size(), r.hits.size() + hits->size(),
+                             r.outs.size(), r.outs.size() + outs->size()});
+      r.hits.insert(r.hits.end(), hits->begin(), hits->end());
+      r.outs.insert(r.outs.end(), outs->begin(), outs->end());
+      at += len + 1;
+    }
+  };
+
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t delivered = 0;  // chunks passed to visit
+  bool stop = false;  // set when the run ends, normally or by an exception
+  std::exception_ptr error;  // the first exception of a worker
+  std::atomic<size_t> nextChunk(0);
+  const size_t window = 4 * stats.threads;  // chunks workers may run ahead
+  auto worker = [&]() {
+    try {
+      SentenceCache cache(opts.cacheBytes);
+      string line;
+      vector<LatticeHit> hits;
+      vector<int32_t> outs;
+      for (size_t c = nextChunk++; c < stats.chunks; c = nextChunk++) {
+        {
+          std::unique_lock<std::mutex> lock(mu);
+          cv.wait(lock, [&] { return stop || c < delivered + window; });
+          if (stop) {
+            return;
+          }
+        }
+        tokenize(c, opts.cacheBytes > 0 ? &cache : nullptr, &line, &hits, &outs);
+        std::lock_guard<std::mutex> lock(mu);
+        results[c].done = true;
+        cv.notify_all();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mu);
+      if (!error) {
+        error = std::current_exception();
+      }
+      stop = true;
+      cv.notify_all();
+    }
+  };
+  // Pool stops and joins the workers on every way out, so a throwing visitor
+  // neither leaves joinable threads nor workers waiting for chunks to be delivered.
+  struct Pool {
+    std::mutex &mu;
+    std::condition_variable &cv;
+    bool &stop;
+    vector<std::thread> threads;
+
+    void join() {
+      {
+        std::lock_guard<std::mutex> lock(mu);
+        stop = true;
+        cv.notify_all();
+      }
+      for (auto &t : threads) {
+        t.join();
+      }
+      threads.clear();
+    }
+    ~Pool() {
+      join();
+    }
+  } pool{mu, cv, stop, {}};
+  for (unsigned t = 0; t < stats.threads && stats.threads > 1; ++t) {
+    pool.threads.emplace_back(worker);
+  }
+
+  SentenceCache cache(opts.cacheBytes);
+  string line;
+  vector<LatticeHit> hits;
+  vector<int32_t> outs;
+  for (size_t c = 0; c < stats.chunks; ++c) {
+    if (pool.threads.empty()) {
+      tokenize(c, opts.cacheBytes > 0 ? &cache : nullptr, &line, &hits, &outs);
+    } else {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock, [&] { return results[c].done || stop; });
+      if (!results[c].done) {
+        break;  // a worker failed
+      }
+    }
+    auto &r = results[c];
+    for (const auto &l : r.lines) {
+      line.assign(text, l.begin, l.len);
+      const LatticeHit *h = r.hits.data();
+      const int32_t *o = r.outs.data();
+      visit(stats.lines++, line, HitSpan{h + l.hitFrom, h + l.hitTo},
+            OutputSpan{o + l.outFrom, o + l.outTo});
+      stats.hits += l.hitTo - l.hitFrom;
+    }
+    r = Result();
+    std::lock_guard<std::mutex> lock(mu);
+    delivered = c + 1;
+    cv.notify_all();
+  }
+  pool.join();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  return stats;
+}
+
+// MastSize summarizes the encoded size of a Mast.
+struct MastSize {
+  size_t outputs = 0;  // edges with an Output operand
+  size_t tails = 0;  // tail words stored in data
+  size_t bytes = 0;  // estimated program and data bytes (ignoring far jumps)
+};
+
+// OutputStats reports the effect of Mast::optimizeOutputs.
+struct OutputStats {
+  MastSize before;
+  MastSize after;
+};
+
+// BuildOptions configures how a Mast is compiled.
+struct BuildOptions {
+  // fuse common instruction pairs into superinstructions (OutputAccept, MatchMatch)
+  bool fuseInstructions = true;
+  // label edges by byte equivalence classes instead of raw bytes
+  bool byteClasses = true;
+  // build a key set (FSA): outputs and tails are dropped and the image omits them
+  bool acceptor = false;
+  // threads for sorting the input; 0 uses the hardware concurrency
+  unsigned sortThreads = 1;
+  // threads for emitting code; 0 uses the hardware concurrency. The program is the
+  // same for any count.
+  unsigned emitThreads = 1;
+  // if nonzero, add a blocked Bloom filter over the keys with this many bits per key.
+  // Whole-key lookups (Search, Contains, SearchSorted, and ContainsBatch without a
+  // dense table) check it first, so most misses never touch prog. It says nothing
+  // about prefixes, so the prefix searches and Lattice don't consult it.
+  uint32_t prefilterBitsPerKey = 0;
+  // if set, the MAST builder saves its state to this file (and path + ".states")
+  // every checkpointInterval keys, resumes from it if the keys it has seen hash like
+  // the input, and removes it when done. A checkpoint only appends the states built
+  // since the last one. If one can't be written, checkpointing stops and the build
+  // goes on without it.
+  string checkpointPath;
+  size_t checkpointInterval = 1 << 22;
+#ifdef FSTDICT_HAS_PMR
+  // if set, the MAST builder allocates its states, their edges and the register from
+  // this resource, e.g. a monotonic_buffer_resource released after the build
+  std::pmr::memory_resource *memory = nullptr;
+#endif
+};
+
+// mast represents a Minimal Acyclic Subsequential Transeducer.
+// The automaton is frozen into a compressed sparse row graph: states are numbered
+// children first (the initial state is the last one) and the edges of state s are
+// [first[s], first[s+1]) sorted by label.
+struct Mast {
+  uint32_t initialState = 0;
+  vector<uint32_t> first;  // edge offsets per state (numStates+1 entries)
+  vector<uint8_t> label;  // per edge
+  vector<uint32_t> next;  // per edge
+  vector<int32_t> output;  // per edge, 0 if none
+  vector<uint8_t> isFinal;  // per state
+  vector<uint32_t> tailFirst;  // tail offsets per state (numStates+1 entries)
+  vector<int32_t> tail;  // sorted tails of each state
+
+  size_t numStates() const {
+    return isFinal.size();
+  }
+
+  // freeze converts states built by buildMAST (numbered by id, children first) into
+  // the CSR layout.
+  void freeze(const vector<shared_ptr<State>> &states) {
+    const size_t n = states.size();
+    first.assign(1, 0);
+    tailFirst.assign(1, 0);
+    isFinal.resize(n);
+    for (const auto &s : states) {
+      size_t begin = label.size();
+      for (const auto &p : s->trans) {
+        label.push_back(p.first);
+      }
+      sort(label.begin() + begin, label.end());
+      for (size_t e = begin; e < label.size(); ++e) {
+        const auto o = s->output.find(label[e]);
+        next.push_back((uint32_t)s->trans.at(label[e])->id);
+        output.push_back(o != s->output.end() ? o->second : 0);
+      }
+      first.push_back((uint32_t)label.size());
+      isFinal[s->id] = s->isFinal;
+      tail.insert(tail.end(), s->tail.begin(), s->tail.end());
+      tailFirst.push_back((uint32_t)tail.size());
+    }
+    initialState = n > 0 ? (uint32_t)(n - 1) : 0;
+  }
+
+  // permute returns a copy whose state k is state order[k] of this one. order must
+  // keep children before parents.
+  Mast permute(const vector<uint32_t> &order) const {
+    Mast m;
+    vector<uint32_t> id(order.size());
+    for (uint32_t k = 0; k < order.size(); ++k) {
+      id[order[k]] = k;
+    }
+    m.initialState = id[initialState];
+    m.first.assign(1, 0);
+    m.tailFirst.assign(1, 0);
+    for (auto s : order) {
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        m.label.push_back(label[e]);
+        m.next.push_back(id[next[e]]);
+        m.output.push_back(output[e]);
+      }
+      m.first.push_back((uint32_t)m.label.size());
+      m.isFinal.push_back(isFinal[s]);
+      m.tail.insert(m.tail.end(), tail.begin() + tailFirst[s], tail.begin() + tailFirst[s+1]);
+      m.tailFirst.push_back((uint32_t)m.tail.size());
+    }
+    return m;
+  }
+
+  // byteClasses partitions the byte values into equivalence classes: two bytes share a
+  // class if every state has the same edge (next state and output) for both, or neither.
+  // Bytes without edges get class 0; the other classes are numbered by their smallest
+  // byte, so relabeled edges stay sorted.
+  array<uint8_t, 256> byteClasses() const {
+    vector<vector<std::tuple<uint32_t, uint32_t, int32_t>>> sig(256);
+    for (uint32_t s = 0; s < numStates(); ++s) {
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        sig[label[e]].push_back(std::make_tuple(s, next[e], output[e]));
+      }
+    }
+    array<uint8_t, 256> order;
+    for (int b = 0; b < 256; ++b) {
+      order[b] = (uint8_t)b;
+    }
+    std::stable_sort(order.begin(), order.end(), [&sig](uint8_t a, uint8_t b) {
+      return sig[a] < sig[b];
+    });
+    array<uint8_t, 256> rep;  // smallest byte with the same signature
+    for (int i = 0; i < 256; ++i) {
+      rep[order[i]] = (i > 0 && sig[order[i]] == sig[order[i-1]]) ? rep[order[i-1]] : order[i];
+    }
+    array<uint8_t, 256> cls;
+    int n = sig[order[0]].empty() ? 1 : 0;
+    for (int b = 0; b < 256; ++b) {
+      if (sig[b].empty()) {
+        cls[b] = 0;
+      } else if (rep[b] == b) {
+        cls[b] = (uint8_t)n++;
+      } else {
+        cls[b] = cls[rep[b]];
+      }
+    }
+    return cls;
+  }
+
+  // relabel returns a copy whose edges are labeled by cls, keeping the edge of the
+  // smallest byte of each class.
+  Mast relabel(const array<uint8_t, 256> &cls) const {
+    array<bool, 256> smallest;
+    array<bool, 256> seen{};
+    for (int b = 0; b < 256; ++b) {
+      smallest[b] = !seen[cls[b]];
+      seen[cls[b]] = true;
+    }
+    Mast m = *this;
+    m.label.clear();
+    m.next.clear();
+    m.output.clear();
+    m.first.assign(1, 0);
+    for (uint32_t s = 0; s < numStates(); ++s) {
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        if (!smallest[label[e]]) {
+          continue;  // the class has an edge already
+        }
+        m.label.push_back(cls[label[e]]);
+        m.next.push_back(next[e]);
+        m.output.push_back(output[e]);
+      }
+      m.first.push_back((uint32_t)m.label.size());
+    }
+    return m;
+  }
+
+  // compactOrder returns a children-first order whose program layout keeps jumps short:
+  // states are laid out depth-first from the initial state, and the children of each
+  // state are placed from the smallest estimated subtree to the largest so that as many
+  // jumps as possible stay within 16 bits.
+  vector<uint32_t> compactOrder() const {
+    const size_t n = numStates();
+    constexpr uint64_t cap = UINT16_MAX + 1;
+    vector<uint64_t> weight(n, 0);
+    for (uint32_t s = 0; s < n; ++s) {
+      uint64_t w = isFinal[s] ? (tailFirst[s] == tailFirst[s+1] ? 1 : 3) : 0;
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        w += (output[e] != 0 ? 2 : 1) + weight[next[e]];
+      }
+      weight[s] = std::min(w, cap);
+    }
+    vector<uint32_t> order;
+    order.reserve(n);
+    vector<char> visited(n, 0);
+    vector<pair<uint32_t, vector<uint32_t>>> stack;  // (state, children left to visit)
+    auto enter = [&](uint32_t s) {
+      visited[s] = 1;
+      vector<uint32_t> children;
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        children.push_back(next[e]);
+      }
+      // visited first = laid out last, so the lightest child ends up next to s
+      std::stable_sort(children.begin(), children.end(), [&](uint32_t a, uint32_t b) {
+        return weight[a] < weight[b];
+      });
+      stack.push_back(make_pair(s, move(children)));
+    };
+    if (n > 0) {
+      enter(initialState);
+    }
+    while (!stack.empty()) {
+      auto &children = stack.back().second;
+      if (children.empty()) {
+        order.push_back(stack.back().first);
+        stack.pop_back();
+        continue;
+      }
+      auto c = children.back();
+      children.pop_back();
+      if (!visited[c]) {
+        enter(c);
+      }
+    }
+    return order;
+  }
+
+  // splitLeaves returns a copy in which final states without edges or tails are laid
+  // out next to their parents. The leaf that ends most keywords has parents all over
+  // the program, and most of them reach it with a far jump word. Here each parent jumps
+  // to the last copy laid out before it, and a new copy goes in when that one may be
+  // out of 16-bit range; a copy is a single Accept word. Positions are estimated
+  // without far jump words, hence the margin in reach.
+  Mast splitLeaves() const {
+    constexpr size_t reach = UINT16_MAX / 4 * 3;
+    auto leaf = [this](uint32_t s) {
+      return s != initialState && isFinal[s] && first[s] == first[s+1] &&
+             tailFirst[s] == tailFirst[s+1];
+    };
+    Mast m;
+    m.first.assign(1, 0);
+    m.tailFirst.assign(1, 0);
+    vector<uint32_t> id(numStates(), UINT32_MAX);  // latest copy of each state
+    vector<size_t> at(numStates(), 0);  // and its position
+    size_t pos = 0;  // words laid out so far, in emission order
+    auto add = [&](uint32_t s) {
+      id[s] = (uint32_t)m.numStates();
+      at[s] = pos;
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        m.label.push_back(label[e]);
+        m.next.push_back(id[next[e]]);
+        m.output.push_back(output[e]);
+      }
+      m.first.push_back((uint32_t)m.label.size());
+      m.isFinal.push_back(isFinal[s]);
+      m.tail.insert(m.tail.end(), tail.begin() + tailFirst[s], tail.begin() + tailFirst[s+1]);
+      m.tailFirst.push_back((uint32_t)m.tail.size());
+      pos += first[s+1] - first[s] + isFinal[s];
+    };
+    for (uint32_t s = 0; s < numStates(); ++s) {
+      if (leaf(s)) {
+        continue;
+      }
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        const auto to = next[e];
+        if (leaf(to) && (id[to] == UINT32_MAX || pos - at[to] > reach)) {
+          add(to);
+        }
+      }
+      add(s);
+    }
+    m.initialState = id[initialState];
+    return m;
+  }
+
+  // edge returns the index of the edge of state s labeled ch, or -1.
+  int64_t edge(uint32_t s, uint8_t ch) const {
+    auto b = label.begin() + first[s];
+    auto e = label.begin() + first[s+1];
+    auto it = std::lower_bound(b, e, ch);
+    if (it == e || *it != ch) {
+      return -1;
+    }
+    return it - label.begin();
+  }
+
+  vector<int32_t> run(const string &input, bool* ok) const {
+    *ok = true;
+    vector<int32_t> out;
+    if (numStates() == 0) {
+      *ok = false;
+      return out;
+    }
+    auto s = initialState;
+    for (size_t i = 0; i < input.length(); ++i) {
+      auto e = edge(s, (uint8_t)input[i]);
+      if (e < 0) {
+        *ok = false;
+        return out;
+      }
+      if (output[e] != 0) {
+        out.push_back(output[e]);
+      }
+      s = next[e];
+    }
+    out.insert(out.end(), tail.begin() + tailFirst[s], tail.begin() + tailFirst[s+1]);
+    return out;
+  }
+
+  bool accept(const string &input) const {
+    if (numStates() == 0) {
+      return false;
+    }
+    auto s = initialState;
+    for (size_t i = 0; i < input.length(); ++i) {
+      auto e = edge(s, (uint8_t)input[i]);
+      if (e < 0) {
+        return false;
+      }
+      s = next[e];
+    }
+    return true;
+  }
+
+  void dot(ostream& w) const {
+    w << "digraph G {";
+    w << "\trankdir=LR;";
+    w << "\tnode [shape=circle]";
+    for (size_t s = 0; s < numStates(); ++s) {
+      if (isFinal[s]) {
+        w << "\t" << dec << s << "[peripheries = 2];" << endl;
+      }
+    }
+    for (size_t s = 0; s < numStates(); ++s) {
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        const auto to = next[e];
+        w << "\t" << dec << s << " -> " << to;
+        w << " [label=\""
+          << setfill('0') << setw(2) << hex << (int)label[e]
+          << dec << "/";
+        if (output[e] != 0) {
+          w << output[e];
+        }
+        for (auto t = tailFirst[to]; t < tailFirst[to+1]; ++t) {
+          w << tail[t] << ", ";
+        }
+        w << "\"];";
+      }
+    }
+    w << "}";
+  }
+
+  // size estimates the program and data size buildMachine would emit.
+  MastSize size() const {
+    MastSize sz;
+    size_t words = label.size();
+    for (auto o : output) {
+      if (o != 0) {
+        ++sz.outputs;
+      }
+    }
+    for (size_t s = 0; s < numStates(); ++s) {
+      if (isFinal[s]) {
+        words += tailFirst[s] == tailFirst[s+1] ? 1 : 3;
+      }
+    }
+    sz.tails = tail.size();
+    words += sz.outputs;
+    sz.bytes = (words + sz.tails) * sizeof(int32_t);
+    return sz;
+  }
+
+  // optimizeOutputs rebalances outputs along paths to shrink the program and data.
+  // An Output sets the single output register that a tail-less Accept reports, so
+  //  - a state whose edges all output v, or whose only tail is v, can have v moved
+  //    onto its incoming edges when that takes fewer words,
+  //  - an edge output is dead if every path from its destination overwrites the
+  //    register before an Accept reads it, and
+  //  - an edge output (or a single-value tail) is redundant if the register already
+  //    holds that value on every path reaching its state.
+  OutputStats optimizeOutputs() {
+    OutputStats stats;
+    stats.before = size();
+    const size_t n = numStates();
+    vector<char> noTail(n, 0);  // tails cleared by this pass
+    auto tails = [&](uint32_t s) -> size_t {
+      return noTail[s] ? 0 : tailFirst[s+1] - tailFirst[s];
+    };
+
+    // incoming edges of each state, in CSR form
+    vector<uint32_t> inFirst(n + 1, 0);
+    for (auto to : next) {
+      ++inFirst[to + 1];
+    }
+    for (size_t s = 0; s < n; ++s) {
+      inFirst[s+1] += inFirst[s];
+    }
+    vector<uint32_t> inEdge(next.size());
+    {
+      vector<uint32_t> pos(inFirst.begin(), inFirst.end() - 1);
+      for (uint32_t e = 0; e < next.size(); ++e) {
+        inEdge[pos[next[e]]++] = e;
+      }
+    }
+
+    // hoist common outputs toward the initial state, children first
+    for (uint32_t s = 0; s < n; ++s) {
+      if (s == initialState || (first[s] == first[s+1] && tails(s) != 1)) {
+        continue;
+      }
+      int32_t v = 0;
+      bool allOut = true;
+      bool same = true;
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        if (output[e] == 0) {
+          allOut = false;
+          break;
+        }
+        same = same && (v == 0 || output[e] == v);
+        v = output[e];
+      }
+      if (!allOut) {
+        continue;
+      }
+      size_t cost = 0;
+      for (auto i = inFirst[s]; i < inFirst[s+1]; ++i) {
+        if (output[inEdge[i]] == 0) {
+          ++cost;
+        }
+      }
+      size_t fanout = first[s+1] - first[s];
+      if (isFinal[s] && tails(s) == 1 && tail[tailFirst[s]] != 0 && cost < 3) {
+        // the tail's range (2 words) and data (1 word) become the register value
+        v = tail[tailFirst[s]];
+        noTail[s] = 1;
+      } else if (same && fanout > 0 && !(isFinal[s] && tails(s) == 0) && cost < fanout) {
+        std::fill(output.begin() + first[s], output.begin() + first[s+1], 0);
+      } else {
+        continue;
+      }
+      for (auto i = inFirst[s]; i < inFirst[s+1]; ++i) {
+        output[inEdge[i]] = v;
+      }
+    }
+
+    // states are ordered children first, so liveness is computed in order
+    vector<char> live(n, 0);
+    for (uint32_t s = 0; s < n; ++s) {
+      bool l = isFinal[s] && tails(s) == 0;
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        if (output[e] == 0 && live[next[e]]) {
+          l = true;
+        }
+      }
+      live[s] = l;
+    }
+    for (uint32_t e = 0; e < next.size(); ++e) {
+      if (!live[next[e]]) {
+        output[e] = 0;
+      }
+    }
+
+    // the register value on arrival, propagated from the initial state
+    enum : uint8_t { kUnset, kSingle, kMultiple };
+    vector<uint8_t> kind(n, kUnset);
+    vector<int32_t> value(n, 0);
+    if (n > 0) {
+      kind[initialState] = kSingle;
+    }
+    for (uint32_t s = (uint32_t)n; s-- > 0;) {
+      if (kind[s] == kSingle && tails(s) == 1 && tail[tailFirst[s]] == value[s]) {
+        noTail[s] = 1;
+      }
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        uint8_t k = kind[s];
+        int32_t v = value[s];
+        if (output[e] != 0) {
+          if (k == kSingle && v == output[e]) {
+            output[e] = 0;
+          } else {
+            k = kSingle;
+            v = output[e];
+          }
+        }
+        auto to = next[e];
+        if (kind[to] == kUnset) {
+          kind[to] = k;
+          value[to] = v;
+        } else if (k != kSingle || kind[to] != kSingle || value[to] != v) {
+          kind[to] = kMultiple;
+        }
+      }
+    }
+
+    // compact the tails
+    size_t w = 0;
+    for (size_t s = 0; s < n; ++s) {
+      size_t begin = w;
+      if (!noTail[s]) {
+        for (auto t = tailFirst[s]; t < tailFirst[s+1]; ++t) {
+          tail[w++] = tail[t];
+        }
+      }
+      tailFirst[s] = (uint32_t)begin;
+    }
+    if (n > 0) {
+      tailFirst[n] = (uint32_t)w;
+    }
+    tail.resize(w);
+
+    stats.after = size();
+    return stats;
+  }
+
+  shared_ptr<FST> buildMachine(string *err, const BuildOptions &opts = BuildOptions()) const {
+    if (opts.acceptor && (!tail.empty() ||
+        std::any_of(output.begin(), output.end(), [](int32_t o) { return o != 0; }))) {
+      Mast m = *this;
+      std::fill(m.output.begin(), m.output.end(), 0);
+      m.tail.clear();
+      std::fill(m.tailFirst.begin(), m.tailFirst.end(), 0);
+      return m.buildMachine(err, opts);
+    }
+    if (opts.byteClasses) {
+      auto classes = byteClasses();
+      BuildOptions raw = opts;
+      raw.byteClasses = false;
+      auto t = relabel(classes).buildMachine(err, raw);
+      if (t) {
+        t->classes = classes;
+        t->index();
+      }
+      return t;
+    }
+    CodeLayout l;
+    if (!layOut(&l, err, opts)) {
+      return nullptr;
+    }
+
+    unsigned threads = opts.emitThreads;
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    CodeBlock code;
+    if (threads <= 1 || !emitParallel(&l, threads, &code)) {
+      code.clear();
+      for (uint32_t b = 0; b < l.blocks.size(); ++b) {
+        l.start[b] = code.prog.size();
+        emitBlock(l, b, l.end, &code);
+      }
+    }
+    auto &prog = code.prog;
+    auto &data = code.data;
+    auto &outs = code.outs;
+    auto &tailRanges = code.tailRanges;
+    auto t = make_shared<FST>();
+    t->prog.resize(prog.size());
+    reverse_copy(prog.begin(), prog.end(), t->prog.begin());
+    t->data = move(data);
+    t->outs.assign(outs.rbegin(), outs.rend());
+    for (auto it = tailRanges.rbegin(); it != tailRanges.rend(); ++it) {
+      t->tailRanges.push_back(it->first);
+      t->tailRanges.push_back(it->second);
+    }
+    t->acceptor = opts.acceptor;
+    t->index();
+    return t;
+  }
+
+  // writeMachine writes the image that buildMachine(err, opts) would Write, with the
+  // prefilter of head, without holding the program. Each block is emitted once, in
+  // emission order, and spilled to temporary files. Program order is the reverse, so
+  // the code, outputs and tail ranges are then read back from the end and written.
+  // Only the layout, one block and a buffer of kSpillChunk words are kept in memory.
+  bool writeMachine(ostream *w, string *err, const BuildOptions &opts, FST head = FST()) const {
+    if (opts.acceptor && (!tail.empty() ||
+        std::any_of(output.begin(), output.end(), [](int32_t o) { return o != 0; }))) {
+      Mast m = *this;
+      std::fill(m.output.begin(), m.output.end(), 0);
+      m.tail.clear();
+      std::fill(m.tailFirst.begin(), m.tailFirst.end(), 0);
+      return m.writeMachine(w, err, opts, move(head));
+    }
+    if (opts.byteClasses) {
+      head.classes = byteClasses();
+      BuildOptions raw = opts;
+      raw.byteClasses = false;
+      return relabel(head.classes).writeMachine(w, err, raw, move(head));
+    }
+    CodeLayout l;
+    if (!layOut(&l, err, opts)) {
+      return false;
+    }
+    Spill<Instruction> prog;
+    Spill<int32_t> outs;
+    Spill<int32_t> ranges;  // pairs into data
+    if (!prog.ok() || !outs.ok() || !ranges.ok()) {
+      *err = "can't create a temporary file";
+      return false;
+    }
+    const auto n = (uint32_t)l.blocks.size();
+    int32_t data = 0;
+    CodeBlock code;
+    for (uint32_t b = 0; b < n; ++b) {
+      code.clear();
+      emitBlock(l, b, l.end, &code);
+      l.start[b+1] = l.start[b] + code.prog.size();
+      prog.append(code.prog.data(), code.prog.size());
+      outs.append(code.outs.data(), code.outs.size());
+      for (const auto &r : code.tailRanges) {
+        const int32_t range[2] = {r.first + data, r.second + data};
+        ranges.append(range, 2);
+      }
+      data += (int32_t)code.data.size();
+    }
+    if (!prog.ok() || !outs.ok() || !ranges.ok()) {
+      *err = "can't write a temporary file";
+      return false;
+    }
+
+    head.acceptor = opts.acceptor;
+    head.writeHeader(w);
+    vector<int32_t> words;
+    if (!opts.acceptor) {
+      // data keeps emission order; outs and tail ranges are reversed like prog
+      WriteUint(w, (size_t)data);
+      for (uint32_t b = 0; b < n; ++b) {
+        const auto s = l.blocks[b];
+        if (isFinal[s]) {
+          for (auto i = tailFirst[s]; i < tailFirst[s+1]; ++i) {
+            WriteUint(w, static_cast<uint32_t>(tail[i]));
+          }
+        }
+      }
+      WriteUint(w, outs.size());
+      for (size_t hi = outs.size(); hi > 0;) {
+        const size_t lo = hi > kSpillChunk ? hi - kSpillChunk : 0;
+        if (!outs.read(lo, hi, &words)) {
+          *err = "can't read a temporary file";
+          return false;
+        }
+        for (auto it = words.rbegin(); it != words.rend(); ++it) {
+          WriteUint(w, static_cast<uint32_t>(*it));
+        }
+        hi = lo;
+      }
+      WriteUint(w, ranges.size());
+      for (size_t hi = ranges.size(); hi > 0;) {
+        const size_t lo = hi > kSpillChunk ? hi - kSpillChunk : 0;  // kSpillChunk is even
+        if (!ranges.read(lo, hi, &words)) {
+          *err = "can't read a temporary file";
+          return false;
+        }
+        for (size_t i = words.size(); i > 0; i -= 2) {
+          WriteUint(w, static_cast<uint32_t>(words[i-2]));
+          WriteUint(w, static_cast<uint32_t>(words[i-1]));
+        }
+        hi = lo;
+      }
+    }
+    // read whole blocks so that a far jump stays next to its instruction
+    WriteUint(w, l.start[n]);
+    for (uint32_t hi = n; hi > 0;) {
+      uint32_t lo = hi - 1;
+      while (lo > 0 && l.start[hi] - l.start[lo-1] <= kSpillChunk) {
+        --lo;
+      }
+      if (!prog.read(l.start[lo], l.start[hi], &code.prog)) {
+        *err = "can't read a temporary file";
+        return false;
+      }
+      reverse(code.prog.begin(), code.prog.end());
+      if (!FST::writeCode(w, code.prog.data(), code.prog.size())) {
+        *err = "undefined operation";
+        return false;
+      }
+      hi = lo;
+    }
+    return !w->fail();
+  }
+
+  static const size_t kSpillChunk = 1 << 16;
+
+  // Spill keeps words of type T on a temporary file: they are all appended first and
+  // then read back in any order.
+  template <typename T>
+  struct Spill {
+    FILE *f = std::tmpfile();
+    size_t n = 0;
+    bool failed = f == nullptr;
+
+    Spill() = default;
+    Spill(const Spill &) = delete;
+    Spill &operator=(const Spill &) = delete;
+    ~Spill() {
+      if (f) {
+        fclose(f);
+      }
+    }
+
+    bool ok() const {
+      return !failed;
+    }
+    size_t size() const {
+      return n;
+    }
+    void append(const T *p, size_t k) {
+      if (!failed && k > 0) {
+        failed = fwrite(p, sizeof(T), k, f) != k;
+        n += k;
+      }
+    }
+    // read replaces buf with words [lo, hi).
+    bool read(size_t lo, size_t hi, vector<T> *buf) {
+      buf->resize(hi - lo);
+      failed = failed || !seek(f, (uint64_t)lo * sizeof(T)) ||
+               fread(buf->data(), sizeof(T), hi - lo, f) != hi - lo;
+      return !failed;
+    }
+    // seek moves f to byte off, which may lie past 2 GB where long has 32 bits; an
+    // offset the platform can't seek to fails.
+    static bool seek(FILE *f, uint64_t off) {
+#if defined(_WIN32)
+      return off <= (uint64_t)INT64_MAX && _fseeki64(f, (__int64)off, SEEK_SET) == 0;
+#elif defined(__unix__) || defined(__APPLE__)
+      return (uint64_t)(off_t)off == off && fseeko(f, (off_t)off, SEEK_SET) == 0;
+#else
+      return off <= (uint64_t)LONG_MAX && fseek(f, (long)off, SEEK_SET) == 0;
+#endif
+    }
+  };
+
+  // CodeLayout places the code in blocks, one per state that isn't inlined, in state
+  // order; a block holds the inlined states its state hosts and then the state itself.
+  // Positions count words in emission (reverse program) order.
+  struct CodeLayout {
+    bool fuse = false;
+    vector<char> inlined;  // per state
+    vector<uint32_t> blocks;  // state of each block
+    vector<uint32_t> blockOf;  // per state
+    vector<size_t> start;  // per block (blocks+1 entries)
+    vector<int> end;  // per state, end of its code relative to its block
+
+    size_t addr(uint32_t s) const {
+      return start[blockOf[s]] + end[s];
+    }
+  };
+
+  // Reloc is a layout-dependent choice made by emitBlock: a jump into another block,
+  // at word pos of the block, or (hoist) whether an inlined Break was placed ahead of
+  // its parent's edges because it might need a far jump to state to.
+  struct Reloc {
+    uint32_t pos;
+    uint32_t to;
+    bool far;  // the jump took a far word, or the Break was hoisted
+    bool hoist;
+  };
+
+  // CodeBlock holds emitted code in emission order. If track is set, emitBlock also
+  // records the relocs of each block, with pos counted from the block's first word.
+  struct CodeBlock {
+    vector<Instruction> prog;
+    vector<int32_t> data;
+    vector<int32_t> outs;  // cold operands
+    vector<pair<int32_t, int32_t>> tailRanges;  // into data
+    bool track = false;
+    vector<Reloc> relocs;
+
+    // Mark is where the code appended next begins in each of the vectors.
+    struct Mark {
+      uint32_t prog, data, outs, ranges, relocs;
+    };
+    Mark mark() const {
+      return Mark{(uint32_t)prog.size(), (uint32_t)data.size(), (uint32_t)outs.size(),
+                  (uint32_t)tailRanges.size(), (uint32_t)relocs.size()};
+    }
+
+    void clear() {
+      prog.clear();
+      data.clear();
+      outs.clear();
+      tailRanges.clear();
+      relocs.clear();
+    }
+  };
+
+  // layOut decides which states are inlined and groups the states into blocks.
+  bool layOut(CodeLayout *l, string *err, const BuildOptions &opts) const {
+    l->fuse = opts.fuseInstructions;
+    // A non-final state whose only edge is a Break without output is emitted inline
+    // right after the MatchMatch of its first parent (so the superinstruction costs no
+    // extra word), unless its child is inlined itself. The initial state has no parent.
+    l->inlined.assign(numStates(), 0);
+    if (opts.fuseInstructions) {
+      for (uint32_t s = 0; s < numStates(); ++s) {
+        l->inlined[s] = s != initialState && !isFinal[s] && first[s+1] - first[s] == 1 &&
+                        output[first[s]] == 0 && !l->inlined[next[first[s]]];
+      }
+    }
+    l->blockOf.assign(numStates(), UINT32_MAX);
+    for (uint32_t s = 0; s < numStates(); ++s) {
+      if (l->inlined[s]) {
+        continue;
+      }
+      const auto b = (uint32_t)l->blocks.size();
+      l->blocks.push_back(s);
+      l->blockOf[s] = b;
+      for (auto e = first[s]; e < first[s+1]; ++e) {
+        auto to = next[e];
+        if (l->inlined[to]) {
+          if (l->blockOf[to] == UINT32_MAX) {
+            l->blockOf[to] = b;
+          }
+        } else if (to >= s) {
+          stringstream ss;
+          ss << "next addr is undefined: state(" << dec << s
+             << "), input(" << hex << (int)label[e] << ")";
+          *err = ss.str();
+          return false;
+        }
+      }
+    }
+    l->start.assign(l->blocks.size() + 1, 0);
+    l->end.assign(numStates(), 0);
+    return true;
+  }
+
+  // emitBlock appends block b to c as if it started at l.start[b]. Jump targets in
+  // other blocks are taken from l; the ends of the states b emits are stored in end,
+  // which may be l.end itself.
+  void emitBlock(const CodeLayout &l, uint32_t b, vector<int> &end, CodeBlock *c) const {
+    const uint32_t s = l.blocks[b];
+    const size_t begin = c->prog.size();
+    const size_t base = l.start[b] - begin;  // position of c->prog[0]
+    auto addr = [&](uint32_t to) -> size_t {
+      return l.blockOf[to] == b ? base + begin + end[to] : l.addr(to);
+    };
+    auto hosted = [&](uint32_t to) {
+      return l.inlined[to] && l.blockOf[to] == b && end[to] < 0;
+    };
+    Instruction code;  // tmp instruction
+    auto emitEdge = [&](uint32_t s, uint32_t e, bool fused) {
+      auto ch = label[e];
+      auto out = output[e];
+      size_t jump = base + c->prog.size() - addr(next[e]) + 1;
+      if (c->track && l.blockOf[next[e]] != b) {
+        c->relocs.push_back(Reloc{(uint32_t)(c->prog.size() - begin), next[e], jump > UINT16_MAX, false});
+      }
+      bool last = (e + 1 == first[s+1]);
+      Operation op;
+      if (fused) {
+        op = last ? Operation::BreakMatch : Operation::MatchMatch;
+      } else if (out != 0) {
+        if (last) {
+          op = Operation::OutputBreak;
+        } else {
+          op = Operation::Output;
+        }
+      } else if (last) {
+        op = Operation::Break;
+      } else {
+        op = Operation::Match;
+      }
+      const auto to = next[e];
+      if (l.fuse && out != 0 && isFinal[to] &&
+          first[to] == first[to+1] && tailFirst[to] == tailFirst[to+1]) {
+        op = last ? Operation::OutputAcceptBreak : Operation::OutputAccept;
+      }
+
+      if (jump > UINT16_MAX) {
+        code.v32 = (int32_t)jump;
+        c->prog.push_back(code);
+        jump = 0;
+      }
+      if (out != 0) {
+        c->outs.push_back(out);
+      }
+
+      code.ops.op = op;
+      code.ops.ch = ch;
+      code.ops.jump = (uint16_t)jump;
+      c->prog.push_back(code);
+    };
+    auto emitInlined = [&](uint32_t to) {
+      emitEdge(to, first[to], false);
+      end[to] = (int)(c->prog.size() - begin);
+    };
+
+    for (auto e = first[s]; e < first[s+1]; ++e) {
+      if (l.inlined[next[e]] && l.blockOf[next[e]] == b) {
+        end[next[e]] = -1;
+      }
+    }
+    // An Output can't host an inlined state, and neither can an edge whose inlined
+    // Break might need a far jump; place those right after s. Each edge of s emits
+    // at most 4 words, which bounds how far the Break can end up from its target.
+    const size_t bound = l.start[b] + 4 * (first[s+1] - first[s]) + 1;
+    for (auto e = first[s]; e < first[s+1]; ++e) {
+      auto to = next[e];
+      if (!hosted(to)) {
+        continue;
+      }
+      const bool far = bound - addr(next[first[to]]) > UINT16_MAX;
+      if (c->track && output[e] == 0) {
+        c->relocs.push_back(Reloc{0, next[first[to]], far, true});
+      }
+      if (output[e] != 0 || far) {
+        emitInlined(to);
+      }
+    }
+    for (auto e = first[s+1]; e-- > first[s];) {
+      auto to = next[e];
+      bool fused = false;
+      if (hosted(to)) {
+        emitInlined(to);
+        fused = true;
+      }
+      emitEdge(s, e, fused);
+    }
+    if (isFinal[s]) {
+      bool hasTail = tailFirst[s] != tailFirst[s+1];
+      if (hasTail) {
+        auto from = (int32_t)c->data.size();
+        c->data.insert(c->data.end(), tail.begin() + tailFirst[s], tail.begin() + tailFirst[s+1]);
+        c->tailRanges.push_back(make_pair(from, (int32_t)c->data.size()));
+      }
+      if (first[s] == first[s+1]) {
+        code.ops.op = Operation::AcceptBreak;
+      } else {
+        code.ops.op = Operation::Accept;
+      }
+      // clear
+      code.ops.ch = 0;
+      code.ops.jump = 0;
+      if (hasTail) {
+        code.ops.ch = 1;
+      }
+      c->prog.push_back(code);
+    }
+    end[s] = (int)(c->prog.size() - begin);
+  }
+
+  // relocate appends block b, kept in from between marks lo and hi, to c and patches
+  // its jumps into other blocks for layout l. Returns false, appending nothing, if a
+  // jump would change its width or an inlined Break its place, in which case the
+  // block must be emitted again.
+  bool relocate(const CodeLayout &l, uint32_t b, const CodeBlock &from,
+                const CodeBlock::Mark &lo, const CodeBlock::Mark &hi, CodeBlock *c) const {
+    const uint32_t s = l.blocks[b];
+    const size_t bound = l.start[b] + 4 * (first[s+1] - first[s]) + 1;
+    for (auto r = from.relocs.begin() + lo.relocs; r != from.relocs.begin() + hi.relocs; ++r) {
+      const size_t far = r->hoist ? bound - l.addr(r->to) : l.start[b] + r->pos - l.addr(r->to) + 1;
+      if ((far > UINT16_MAX) != r->far) {
+        return false;
+      }
+    }
+    const size_t begin = c->prog.size();
+    const auto d = (int32_t)c->data.size() - (int32_t)lo.data;
+    c->prog.insert(c->prog.end(), from.prog.begin() + lo.prog, from.prog.begin() + hi.prog);
+    c->data.insert(c->data.end(), from.data.begin() + lo.data, from.data.begin() + hi.data);
+    c->outs.insert(c->outs.end(), from.outs.begin() + lo.outs, from.outs.begin() + hi.outs);
+    for (auto r = from.tailRanges.begin() + lo.ranges; r != from.tailRanges.begin() + hi.ranges; ++r) {
+      c->tailRanges.push_back(make_pair(r->first + d, r->second + d));
+    }
+    c->relocs.insert(c->relocs.end(), from.relocs.begin() + lo.relocs, from.relocs.begin() + hi.relocs);
+    for (auto r = from.relocs.begin() + lo.relocs; r != from.relocs.begin() + hi.relocs; ++r) {
+      if (r->hoist) {
+        continue;
+      }
+      const size_t jump = l.start[b] + r->pos - l.addr(r->to) + 1;
+      if (r->far) {
+        c->prog[begin + r->pos].v32 = (int32_t)jump;
+      } else {
+        c->prog[begin + r->pos].ops.jump = (uint16_t)jump;
+      }
     }
     return true;
   }
 
-  void dot(ostream& w) {
-    w << "digraph G {";
-    w << "\trankdir=LR;";
-    w << "\tnode [shape=circle]";
-    for (const auto &s : finalStates) {
-      w << "\t" << dec << s->id << "[peripheries = 2];" << endl;
-    }
-    for (const auto &from : states) {
-      for (const auto &p : from->trans) {
-        const auto &in = p.first;
-        const auto &to = p.second;
-        w << "\t" << from->id << " -> " << to->id;
-        w << " [label=\""
-          << setfill('0') << setw(2) << hex << in
-          << dec << from->output.at(in);
-        if (to->hasTail()) {
-          for (const auto &t : to->getTails()) {
-            w << t << ", ";
+  // emitParallel emits all blocks of l into c on several threads. Block sizes depend
+  // on which jumps are far, so the blocks are emitted against the previous round's
+  // layout until it stops changing. The code is kept between rounds, one CodeBlock
+  // per chunk of blocks: when the layout moves, a block whose jumps all keep their
+  // width is relocated, and only the others are emitted again. Jumps only grow, so a
+  // handful of rounds suffice; the result is what the serial emitter produces.
+  // Returns false if it doesn't settle.
+  bool emitParallel(CodeLayout *l, unsigned threads, CodeBlock *c) const {
+    static const int kMaxRounds = 32;
+    static const uint32_t kChunk = 256;
+    const auto n = (uint32_t)l->blocks.size();
+    const uint32_t chunks = (n + kChunk - 1) / kChunk;
+    auto run = [&](const std::function<void(uint32_t)> &f) {
+      std::atomic<uint32_t> nextChunk(0);
+      auto worker = [&]() {
+        for (uint32_t i = nextChunk++; i < chunks; i = nextChunk++) {
+          f(i);
+        }
+      };
+      vector<std::thread> pool;
+      for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(worker);
+      }
+      worker();
+      for (auto &t : pool) {
+        t.join();
+      }
+    };
+
+    vector<CodeBlock> code(chunks);
+    vector<CodeBlock::Mark> at(n + chunks);  // block b of chunk i begins at at[b + i]
+    vector<int> end(l->end.size(), 0);  // of the current code of each block
+    bool settled = false;
+    for (int round = 0; round < kMaxRounds && !settled; ++round) {
+      run([&](uint32_t i) {
+        CodeBlock next;
+        next.track = true;
+        for (uint32_t b = i * kChunk; b < n && b < (i + 1) * kChunk; ++b) {
+          const auto m = next.mark();
+          if (round == 0 || !relocate(*l, b, code[i], at[b + i], at[b + i + 1], &next)) {
+            emitBlock(*l, b, end, &next);
           }
+          at[b + i] = m;
         }
-        w << "\"];";
+        at[std::min(n, (i + 1) * kChunk) + i] = next.mark();
+        code[i] = move(next);
+      });
+      settled = end == l->end;
+      for (uint32_t b = 0; b < n; ++b) {
+        const uint32_t i = b / kChunk;
+        const size_t next = l->start[b] + at[b + i + 1].prog - at[b + i].prog;
+        settled = settled && l->start[b+1] == next;
+        l->start[b+1] = next;
       }
+      l->end = end;
     }
-    w << "}";
+    if (!settled) {
+      return false;
+    }
+    vector<size_t> outsAt(chunks + 1, 0), dataAt(chunks + 1, 0), rangesAt(chunks + 1, 0);
+    for (uint32_t i = 0; i < chunks; ++i) {
+      outsAt[i+1] = outsAt[i] + code[i].outs.size();
+      dataAt[i+1] = dataAt[i] + code[i].data.size();
+      rangesAt[i+1] = rangesAt[i] + code[i].tailRanges.size();
+    }
+    c->prog.resize(l->start[n]);
+    c->outs.resize(outsAt[chunks]);
+    c->data.resize(dataAt[chunks]);
+    c->tailRanges.resize(rangesAt[chunks]);
+    run([&](uint32_t i) {
+      const auto &k = code[i];
+      std::copy(k.prog.begin(), k.prog.end(), c->prog.begin() + l->start[i * kChunk]);
+      std::copy(k.outs.begin(), k.outs.end(), c->outs.begin() + outsAt[i]);
+      std::copy(k.data.begin(), k.data.end(), c->data.begin() + dataAt[i]);
+      auto d = (int32_t)dataAt[i];
+      for (size_t j = 0; j < k.tailRanges.size(); ++j) {
+        const auto &r = k.tailRanges[j];
+        c->tailRanges[rangesAt[i] + j] = make_pair(r.first + d, r.second + d);
+      }
+      code[i] = CodeBlock();
+    });
+    return true;
   }
+};
 
-  shared_ptr<FST> buildMachine(string *err) {
-    vector<Instruction> prog;
-    vector<int32_t> data;
-    Instruction code;  // tmp instruction
+inline OptimizeStats FST::Optimize() {
+  OptimizeStats stats;
+  stats.before = Stats();
+  if (!runnable()) {
+    stats.after = stats.before;
+    return stats;
+  }
 
-    set<uint8_t> edges;
-    unordered_map<int, int> addrMap;
-    for (auto s : states) {
-      edges.clear();
-      for (auto p : s->trans) {
-        edges.insert(p.first);
-      }
-      for (auto it = edges.crbegin(); it != edges.crend(); ++it) {
-        auto ch = *it;
-        auto next = s->trans.at(ch);
-        auto out = s->output.at(ch);
-        auto itAddr = addrMap.find(next->id);
-        if (itAddr == addrMap.end() && !next->isFinal) {
-          stringstream ss;
-          ss << "next addr is undefined: state(" << dec << s->id
-             << "), input(" << hex << ch << ")";
-          *err = ss.str();
-        }
-        size_t jump = prog.size() - itAddr->second + 1;
-        Operation op;
-        if (out != 0) {
-          if (it == edges.crbegin()) {
-            op = Operation::OutputBreak;
-          } else {
-            op = Operation::Output;
-          }
-        } else if (it == edges.crbegin()) {
-          op = Operation::Break;
-        } else {
-          op = Operation::Match;
-        }
-        
-        if (jump > UINT16_MAX) {
-          code.v32 = (int32_t)jump;
-          prog.push_back(code);
-          jump = 0;
-        }
-        if (out != 0) {
-          code.v32 = (int32_t)out;
-          prog.push_back(code);
-        }
+  // post-order walk from the initial state; identical states get the same id
+  Mast m;
+  m.first.assign(1, 0);
+  m.tailFirst.assign(1, 0);
+  unordered_map<int, uint32_t> ids;  // pc -> new state id
+  unordered_map<string, uint32_t> canon;
+  vector<pair<int, StateCode>> stack;
+  stack.push_back(make_pair(0, decodeState(0)));
+  vector<size_t> progress(1, 0);  // next edge to visit per stack entry
+  while (!stack.empty()) {
+    auto &top = stack.back();
+    auto &i = progress.back();
+    if (i < top.second.edges.size()) {
+      int next = top.second.edges[i++].next;
+      if (ids.count(next) == 0) {
+        stack.push_back(make_pair(next, decodeState(next)));
+        progress.push_back(0);
+      }
+      continue;
+    }
+    const auto &s = top.second;
+    string key;
+    key.push_back(s.isFinal ? 1 : 0);
+    auto append = [&key](uint32_t v) {
+      key.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    };
+    append((uint32_t)std::max(0, s.tailTo - s.tailFrom));
+    for (int t = s.tailFrom; t < s.tailTo; ++t) {
+      append((uint32_t)data[t]);
+    }
+    for (const auto &t : s.edges) {
+      key.push_back((char)t.ch);
+      append((uint32_t)t.out);
+      append(ids.at(t.next));
+    }
+    auto it = canon.find(key);
+    if (it != canon.end()) {
+      ids[top.first] = it->second;
+    } else {
+      uint32_t id = (uint32_t)m.isFinal.size();
+      canon.insert(make_pair(key, id));
+      ids[top.first] = id;
+      for (const auto &t : s.edges) {
+        m.label.push_back(t.ch);
+        m.next.push_back(ids.at(t.next));
+        m.output.push_back(t.out);
+      }
+      m.first.push_back((uint32_t)m.label.size());
+      m.isFinal.push_back(s.isFinal);
+      for (int t = s.tailFrom; t < s.tailTo; ++t) {
+        m.tail.push_back(data[t]);
+      }
+      m.tailFirst.push_back((uint32_t)m.tail.size());
+    }
+    stack.pop_back();
+    progress.pop_back();
+  }
+  m.initialState = ids.at(0);
 
-        code.ops.op = op;
-        code.ops.ch = ch;
-        code.ops.jump = (uint16_t)jump;
-        prog.push_back(code);
+  // keep the smallest of the plain and the compact depth-first layout, each with and
+  // without split leaves
+  string err;
+  BuildOptions opts;
+  opts.acceptor = acceptor;
+  const Mast compact = m.permute(m.compactOrder());
+  const Mast split = m.splitLeaves();
+  const Mast compactSplit = compact.splitLeaves();
+  const Mast *layouts[] = {&m, &compact, &split, &compactSplit};
+  shared_ptr<FST> t;
+  for (auto c : layouts) {
+    auto u = c->buildMachine(&err, opts);
+    if (u && (!t || u->Stats().bytes < t->Stats().bytes)) {
+      t = u;
+    }
+  }
+  if (t) {
+    t->prefilter = prefilter;
+    // m is labeled by our class ids; compose with the classes t found over those
+    array<uint8_t, 256> composed;
+    for (int b = 0; b < 256; ++b) {
+      composed[b] = t->classes[classes[b]];
+    }
+    t->classes = composed;
+    t->index();
+  }
+  if (t && t->Stats().bytes <= stats.before.bytes) {
+    *this = move(*t);
+  }
+  stats.after = Stats();
+  return stats;
+}
+
+// SortKey is a byte string to be sorted by sortPairs and the index of its Pair.
+// The sorts read bytes from cache, a big-endian copy of the aligned 8-byte block of the
+// current depth, so that only every eighth level chases the key pointers.
+struct SortKey {
+  const uint8_t *p;
+  uint32_t len;
+  uint32_t idx;
+  uint64_t cache;
+
+  // cached returns the byte at depth d, or -1 past the end (which sorts first).
+  int cached(size_t d) const {
+    return d < len ? (int)((cache >> (56 - 8 * (d % 8))) & 0xFF) : -1;
+  }
+
+  // fill caches the block of depth d.
+  void fill(size_t d) {
+    d -= d % 8;
+    cache = 0;
+    for (size_t i = d; i < d + 8 && i < len; ++i) {
+      cache |= uint64_t(p[i]) << (56 - 8 * (i - d));
+    }
+  }
+};
+
+// multikeyQuicksort sorts keys that share their first depth bytes by three-way
+// partitioning on one byte at a time; tiny ranges are insertion sorted. The caches
+// must hold the block of depth.
+inline void multikeyQuicksort(SortKey *a, size_t n, size_t depth) {
+  while (n > 16) {
+    int x = a[0].cached(depth), y = a[n/2].cached(depth), z = a[n-1].cached(depth);
+    int pivot = std::max(std::min(x, y), std::min(std::max(x, y), z));
+    size_t lt = 0, i = 0, gt = n;
+    while (i < gt) {
+      int c = a[i].cached(depth);
+      if (c < pivot) {
+        swap(a[lt++], a[i++]);
+      } else if (c > pivot) {
+        swap(a[i], a[--gt]);
+      } else {
+        ++i;
       }
-      if (s->isFinal) {
-        if (!s->tail.empty()) {
-          code.v32 = (int32_t)data.size();
-          prog.push_back(code);
-          for (auto t : s->tail) {
-            data.push_back(t);
-          }
-          code.v32 = (int32_t)data.size();
-          prog.push_back(code);
-        }
-        if (s->trans.empty()) {
-          code.ops.op = Operation::Accept;
-        } else {
-          code.ops.op = Operation::AcceptBreak;
-        }
-        // clear
-        code.ops.ch = 0;
-        code.ops.jump = 0;
-        if (!s->tail.empty()) {
-          code.ops.ch = 1;
+    }
+    multikeyQuicksort(a, lt, depth);
+    multikeyQuicksort(a + gt, n - gt, depth);
+    if (pivot < 0) {
+      return;  // the middle keys end here and are equal
+    }
+    a += lt;
+    n = gt - lt;
+    if (++depth % 8 == 0) {
+      for (size_t k = 0; k < n; ++k) {
+        a[k].fill(depth);
+      }
+    }
+  }
+  for (size_t i = 1; i < n; ++i) {
+    SortKey k = a[i];
+    size_t j = i;
+    for (; j > 0; --j) {
+      const SortKey &b = a[j-1];
+      size_t m = std::min(k.len, b.len);
+      int c = m > depth ? memcmp(b.p + depth, k.p + depth, m - depth) : 0;
+      if (c < 0 || (c == 0 && b.len <= k.len)) {
+        break;
+      }
+      a[j] = b;
+    }
+    a[j] = k;
+  }
+}
+
+// msdRadixSort distributes keys sharing their first depth bytes into 257 buckets (end
+// of key, then each byte value) and recurses; buckets below a threshold go to
+// multikeyQuicksort. The caches must hold the block of depth and tmp has room for n
+// keys. With threads > 1 the top-level buckets are sorted in parallel.
+inline void msdRadixSort(SortKey *a, SortKey *tmp, size_t n, size_t depth, unsigned threads) {
+  size_t count[258];
+  for (;;) {
+    if (n < 4096) {
+      multikeyQuicksort(a, n, depth);
+      return;
+    }
+    std::fill(count, count + 258, 0);
+    for (size_t i = 0; i < n; ++i) {
+      ++count[a[i].cached(depth) + 2];
+    }
+    if (std::find(count + 2, count + 258, n) == count + 258) {
+      break;
+    }
+    // all keys share this byte, as in long common prefixes: skip the whole common
+    // prefix in one pass instead of one counting pass per byte
+    const SortKey &f = a[0];
+    size_t end = f.len;
+    for (size_t i = 1; i < n && end > depth + 1; ++i) {
+      size_t j = depth + 1;
+      size_t m = std::min<size_t>(end, a[i].len);
+      while (j < m && a[i].p[j] == f.p[j]) {
+        ++j;
+      }
+      end = j;
+    }
+    depth = end;
+    for (size_t i = 0; i < n; ++i) {
+      a[i].fill(depth);
+    }
+  }
+  for (int b = 1; b < 258; ++b) {
+    count[b] += count[b-1];
+  }
+  size_t pos[257];
+  std::copy(count, count + 257, pos);
+  for (size_t i = 0; i < n; ++i) {
+    tmp[pos[a[i].cached(depth) + 1]++] = a[i];
+  }
+  std::copy(tmp, tmp + n, a);
+  if (++depth % 8 == 0) {
+    for (size_t i = 0; i < n; ++i) {
+      a[i].fill(depth);
+    }
+  }
+  // bucket b (byte b-1) is [count[b], count[b+1]); bucket 0 ends here and is sorted
+  if (threads <= 1) {
+    for (int b = 1; b < 257; ++b) {
+      size_t from = count[b], len = count[b+1] - count[b];
+      if (len > 1) {
+        msdRadixSort(a + from, tmp + from, len, depth, 1);
+      }
+    }
+    return;
+  }
+  std::atomic<int> nextBucket(1);
+  auto worker = [&]() {
+    for (int b = nextBucket++; b < 257; b = nextBucket++) {
+      size_t from = count[b], len = count[b+1] - count[b];
+      if (len > 1) {
+        msdRadixSort(a + from, tmp + from, len, depth, 1);
+      }
+    }
+  };
+  vector<std::thread> pool;
+  for (unsigned t = 1; t < threads; ++t) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : pool) {
+    t.join();
+  }
+}
+
+// sortPairs sorts input by key like std::sort would, but with an MSD radix sort over
+// the key bytes, and returns at once if the input is sorted already.
+inline void sortPairs(vector<Pair> *input, unsigned threads = 1) {
+  const size_t n = input->size();
+  bool sorted = true;
+  for (size_t i = 1; i < n && sorted; ++i) {
+    sorted = !((*input)[i] < (*input)[i-1]);
+  }
+  if (sorted) {
+    return;
+  }
+  if (n > UINT32_MAX) {
+    sort(input->begin(), input->end());
+    return;
+  }
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  vector<SortKey> keys(n), tmp(n);
+  for (size_t i = 0; i < n; ++i) {
+    const auto &in = (*input)[i].in;
+    keys[i] = SortKey{reinterpret_cast<const uint8_t *>(in.data()), (uint32_t)in.size(), (uint32_t)i, 0};
+    keys[i].fill(0);
+  }
+  msdRadixSort(keys.data(), tmp.data(), n, 0, threads);
+  vector<Pair> out;
+  out.reserve(n);
+  for (const auto &k : keys) {
+    out.push_back(move((*input)[k.idx]));
+  }
+  input->swap(out);
+}
+
+// PairSource reads a sorted vector<Pair> for buildSortedMAST. A source is a cheap
+// copyable cursor: next points *in at the next key, which stays valid until the
+// following call, and stores the length of its common prefix with the previous key.
+struct PairSource {
+  const vector<Pair> *pairs;
+  size_t i = 0;
+
+  explicit PairSource(const vector<Pair> *p) : pairs(p) {}
+
+  size_t maxKeyLen() const {
+    size_t n = 0;
+    for (const auto &pair : *pairs) {
+      n = std::max(n, pair.in.size());
+    }
+    return n;
+  }
+
+  bool next(const string **in, int32_t *out, size_t *lcp) {
+    if (i == pairs->size()) {
+      return false;
+    }
+    const auto &pair = (*pairs)[i];
+    *in = &pair.in;
+    *out = pair.out;
+    *lcp = i > 0 ? commonPrefixLen(pair.in, (*pairs)[i-1].in) : 0;
+    ++i;
+    return true;
+  }
+};
+
+// FrontCodedKeys holds sorted keys and their outputs for BuildFST without a string per
+// key: each key is stored as the length of the prefix it shares with the previous key
+// and the rest of its bytes, packed into pages.
+struct FrontCodedKeys {
+  static constexpr size_t pageSize = 64 << 10;
+
+  // Add appends a key, which must not sort before the previous one; otherwise it
+  // returns false and the key is not added.
+  bool Add(const string &key, int32_t out) {
+    if (!outs.empty() && key < last) {
+      return false;
+    }
+    size_t lcp = outs.empty() ? 0 : commonPrefixLen(key, last);
+    size_t suffix = key.size() - lcp;
+    if (pages.empty() || pages.back().size() + suffix + 20 > pages.back().capacity()) {
+      pages.emplace_back();
+      pages.back().reserve(suffix + 20 > pageSize ? suffix + 20 : pageSize);
+    }
+    auto &page = pages.back();
+    putVarint(&page, lcp);
+    putVarint(&page, suffix);
+    page.insert(page.end(), key.begin() + lcp, key.end());
+    outs.push_back(out);
+    last.resize(lcp);
+    last.append(key, lcp, string::npos);
+    maxLen = std::max(maxLen, key.size());
+    return true;
+  }
+
+  size_t size() const {
+    return outs.size();
+  }
+
+  bool empty() const {
+    return outs.empty();
+  }
+
+  size_t maxKeyLen() const {
+    return maxLen;
+  }
+
+  // bytes returns the memory held by the container.
+  size_t bytes() const {
+    size_t n = outs.capacity() * sizeof(int32_t) + pages.capacity() * sizeof(pages[0]);
+    for (const auto &page : pages) {
+      n += page.capacity();
+    }
+    return n;
+  }
+
+  // Reader decodes the keys in order; it is a source for buildSortedMAST.
+  struct Reader {
+    const FrontCodedKeys *keys;
+    size_t i = 0, page = 0, off = 0;
+    string key;
+
+    size_t maxKeyLen() const {
+      return keys->maxLen;
+    }
+
+    bool next(const string **in, int32_t *out, size_t *lcp) {
+      if (i == keys->outs.size()) {
+        return false;
+      }
+      if (off == keys->pages[page].size()) {
+        ++page;
+        off = 0;
+      }
+      const auto &p = keys->pages[page];
+      *lcp = getVarint(p, &off);
+      size_t suffix = getVarint(p, &off);
+      key.resize(*lcp);
+      key.append(reinterpret_cast<const char *>(p.data() + off), suffix);
+      off += suffix;
+      *in = &key;
+      *out = keys->outs[i++];
+      return true;
+    }
+  };
+
+  Reader reader() const {
+    Reader r;
+    r.keys = this;
+    return r;
+  }
+
+ private:
+  vector<vector<uint8_t>> pages;
+  vector<int32_t> outs;
+  string last;
+  size_t maxLen = 0;
+
+  static void putVarint(vector<uint8_t> *page, size_t v) {
+    for (; v >= 0x80; v >>= 7) {
+      page->push_back((uint8_t)(v | 0x80));
+    }
+    page->push_back((uint8_t)v);
+  }
+
+  static size_t getVarint(const vector<uint8_t> &page, size_t *off) {
+    size_t v = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t b = page[(*off)++];
+      v |= size_t(b & 0x7F) << shift;
+      if (b < 0x80) {
+        return v;
+      }
+    }
+  }
+};
+
+// MastCheckpoint is the state of buildSortedMAST between two keys: the number of keys
+// read and a hash of them, the last key, the registered states (by id, so children
+// come first) and the frontier buf[0..len(last)]. Frontier state i has an edge along
+// the last key to frontier state i+1, which is written as id -1. Registered states
+// never change, so they go to a second file, path + ".states", which each Save only
+// appends the new ones to; the checkpoint at path is small and rewritten.
+struct MastCheckpoint {
+  static constexpr uint32_t magic = 0x4d415354;  // "MAST"
+  bool keysOnly = false;
+  size_t consumed = 0;
+  uint64_t hash = 0;  // of the consumed keys and outputs, see mix
+  string prev;
+  vector<shared_ptr<State>> states;
+  vector<shared_ptr<State>> frontier;
+
+  // mix adds a key and its output to the hash h of the keys before it.
+  static uint64_t mix(uint64_t h, const string &key, int32_t out) {
+    h = (h ^ BloomFilter::hash(key)) * 0xC4CEB9FE1A85EC53ULL;
+    h = (h ^ (uint32_t)out) * 0xFF51AFD7ED558CCDULL;
+    return h ^ (h >> 29);
+  }
+
+  // Save appends the states added since the last Save or Load to path + ".states",
+  // then writes the rest to a temporary file and renames it over path, so a build
+  // stopped while saving leaves the previous checkpoint intact.
+  bool Save(const string &path) {
+    const string statesPath = path + ".states";
+    uint64_t bytes;
+    {
+      std::fstream w;
+      if (written == 0) {
+        w.open(statesPath, std::ios::binary | std::ios::out | std::ios::trunc);
+      } else {
+        w.open(statesPath, std::ios::binary | std::ios::in | std::ios::out);
+        w.seekp(writtenBytes);
+      }
+      for (size_t i = written; i < states.size() && w; ++i) {
+        writeState(&w, *states[i], nullptr);
+      }
+      if (!w.flush()) {
+        return false;
+      }
+      bytes = static_cast<uint64_t>(w.tellp());
+    }
+    const string tmp = path + ".tmp";
+    {
+      std::ofstream w(tmp, std::ios::binary | std::ios::trunc);
+      WriteUint(&w, magic);
+      WriteUint(&w, static_cast<uint8_t>(keysOnly));
+      WriteUint(&w, static_cast<uint64_t>(consumed));
+      WriteUint(&w, hash);
+      WriteUint(&w, static_cast<uint64_t>(prev.size()));
+      w.write(prev.data(), prev.size());
+      WriteUint(&w, static_cast<uint64_t>(states.size()));
+      WriteUint(&w, bytes);
+      WriteUint(&w, static_cast<uint64_t>(frontier.size()));
+      for (size_t i = 0; i < frontier.size(); ++i) {
+        writeState(&w, *frontier[i], i + 1 < frontier.size() ? frontier[i+1].get() : nullptr);
+      }
+      if (!w.flush()) {
+        w.close();
+        std::remove(tmp.c_str());
+        return false;
+      }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+    written = states.size();
+    writtenBytes = bytes;
+    return true;
+  }
+
+  // Load reads a checkpoint written by Save; it fails on a missing or damaged file.
+  // The states are made by newState, by default make_shared.
+  bool Load(const string &path, std::function<shared_ptr<State>()> newState = nullptr) {
+    if (!newState) {
+      newState = []() { return make_shared<State>(); };
+    }
+    std::ifstream r(path, std::ios::binary);
+    if (!r || ReadUint<uint32_t>(&r) != magic) {
+      return false;
+    }
+    keysOnly = ReadUint<uint8_t>(&r) != 0;
+    consumed = ReadUint<uint64_t>(&r);
+    hash = ReadUint<uint64_t>(&r);
+    const auto len = ReadUint<uint64_t>(&r);
+    if (!r || len > UINT32_MAX) {
+      return false;
+    }
+    prev.resize(len);
+    r.read(&prev[0], prev.size());
+    const auto n = ReadUint<uint64_t>(&r);
+    const auto bytes = ReadUint<uint64_t>(&r);
+    states.clear();
+    frontier.clear();
+    {
+      std::ifstream rs(path + ".states", std::ios::binary);
+      for (uint64_t i = 0; i < n && rs; ++i) {
+        states.push_back(readState(&rs, i, nullptr, newState));
+        if (!states.back()) {
+          return false;
         }
-        prog.push_back(code);
       }
-      addrMap.insert(make_pair(s->id, (int)prog.size()));
+      if (!rs || static_cast<uint64_t>(rs.tellg()) != bytes) {
+        return false;
+      }
     }
-    auto t = make_shared<FST>();
-    reverse_copy(prog.begin(), prog.end(), t->prog.begin());
-    t->data = move(data);
-    return t;
+    const auto f = ReadUint<uint64_t>(&r);
+    if (f != prev.size() + 1) {
+      return false;
+    }
+    frontier.resize(f);
+    for (size_t i = 0; i < f; ++i) {
+      frontier[i] = newState();
+    }
+    for (size_t i = 0; i < f && r; ++i) {
+      auto s = readState(&r, states.size(), i + 1 < f ? frontier[i+1] : nullptr, newState);
+      if (!s) {
+        return false;
+      }
+      *frontier[i] = *s;
+      frontier[i]->id = 0;
+    }
+    written = n;
+    writtenBytes = bytes;
+    return !r.fail();
+  }
+
+  // Remove deletes the files of the checkpoint at path.
+  static void Remove(const string &path) {
+    std::remove(path.c_str());
+    std::remove((path + ".states").c_str());
+  }
+
+ private:
+  size_t written = 0;  // states in the states file
+  uint64_t writtenBytes = 0;  // their size
+
+  static void writeState(ostream *w, const State &s, const State *frontierNext) {
+    WriteUint(w, static_cast<uint8_t>(s.isFinal));
+    WriteUint(w, static_cast<uint64_t>(s.hcode));
+    WriteUint(w, static_cast<uint32_t>(s.trans.size()));
+    for (const auto &t : s.trans) {
+      WriteUint(w, t.first);
+      WriteUint(w, static_cast<uint32_t>(t.second.get() == frontierNext ? -1 : t.second->id));
+    }
+    WriteUint(w, static_cast<uint32_t>(s.output.size()));
+    for (const auto &o : s.output) {
+      WriteUint(w, o.first);
+      WriteUint(w, static_cast<uint32_t>(o.second));
+    }
+    WriteUint(w, static_cast<uint32_t>(s.tail.size()));
+    for (auto t : s.tail) {
+      WriteUint(w, static_cast<uint32_t>(t));
+    }
+  }
+
+  // readState reads a state whose edges lead to states[0..limit) or, as id -1, to
+  // frontierNext.
+  shared_ptr<State> readState(istream *r, size_t limit, const shared_ptr<State> &frontierNext,
+                              const std::function<shared_ptr<State>()> &newState) const {
+    auto s = newState();
+    s->id = (int)limit;
+    s->isFinal = ReadUint<uint8_t>(r) != 0;
+    s->hcode = static_cast<int64_t>(ReadUint<uint64_t>(r));
+    for (auto k = ReadUint<uint32_t>(r); k > 0 && *r; --k) {
+      auto ch = ReadUint<uint8_t>(r);
+      auto to = static_cast<int32_t>(ReadUint<uint32_t>(r));
+      if (to == -1 && frontierNext) {
+        s->trans[ch] = frontierNext;
+      } else if (to >= 0 && (size_t)to < limit) {
+        s->trans[ch] = states[to];
+      } else {
+        return nullptr;
+      }
+    }
+    for (auto k = ReadUint<uint32_t>(r); k > 0 && *r; --k) {
+      auto ch = ReadUint<uint8_t>(r);
+      s->output[ch] = static_cast<int32_t>(ReadUint<uint32_t>(r));
+    }
+    for (auto k = ReadUint<uint32_t>(r); k > 0 && *r; --k) {
+      s->tail.insert(static_cast<int32_t>(ReadUint<uint32_t>(r)));
+    }
+    return s;
   }
 };
 
-shared_ptr<Mast> buildMAST(vector<Pair> *input) {
+// buildSortedMAST builds a MAST from the sorted keys of src. For an acceptor, outputs
+// are ignored and duplicate keys are skipped. With a checkpoint path, the build is
+// saved periodically and resumed as described at BuildOptions.
+template <typename Source>
+shared_ptr<Mast> buildSortedMAST(Source src, const BuildOptions &opts) {
   auto m = make_shared<Mast>();
-
-  sort(input->begin(), input->end());
+  const bool keysOnly = opts.acceptor;
+  const string &checkpointPath = opts.checkpointPath;
+  const size_t checkpointInterval = opts.checkpointInterval;
 
   constexpr size_t initialMASTSize = 1024;
+#ifdef FSTDICT_HAS_PMR
+  auto *mr = opts.memory ? opts.memory : std::pmr::get_default_resource();
+  std::pmr::polymorphic_allocator<State> alloc(mr);
+  auto newState = [&alloc]() { return std::allocate_shared<State>(alloc); };
+  auto copyState = [&alloc](const State &s) { return std::allocate_shared<State>(alloc, s); };
+  std::pmr::unordered_map<int64_t, std::pmr::vector<shared_ptr<State>>> dict(mr);
+#else
+  auto newState = []() { return make_shared<State>(); };
+  auto copyState = [](const State &s) { return make_shared<State>(s); };
   unordered_map<int64_t, vector<shared_ptr<State>>> dict;
-  m->states.clear();
-  m->states.reserve(initialMASTSize);
-  m->finalStates.clear();
-  m->finalStates.reserve(initialMASTSize);
+#endif
+  MastCheckpoint cp;  // holds the states, so a checkpoint can append the new ones
+  auto &states = cp.states;
+  auto addState = [&states](shared_ptr<State> n) {
+    n->id = states.size();
+    states.push_back(n);
+  };
 
-  size_t maxInputWordLen = 0;
-  for (const auto &pair : *input) {
-    if (pair.in.size() > maxInputWordLen) {
-      maxInputWordLen = pair.in.size();
-    }
-  }
+  size_t maxInputWordLen = src.maxKeyLen();
 
   vector<shared_ptr<State>> buf(maxInputWordLen+1);
   for (size_t i = 0; i < buf.size(); ++i) {
-    buf[i] = make_shared<State>();
+    buf[i] = newState();
   }
 
   string prev;
-  for (const auto &pair : *input) {
-    auto in = pair.in;
-    auto out = pair.out;
+  bool first = true;
+  size_t consumed = 0, saved = 0;  // keys read from src, in total and at the last checkpoint
+  uint64_t hash = 0;  // of the keys read
+  bool resumed = false;
+  if (!checkpointPath.empty() && cp.Load(checkpointPath, newState) && cp.keysOnly == keysOnly &&
+      cp.frontier.size() <= buf.size()) {
+    // skip the keys the checkpoint has seen; if they don't hash like the keys it
+    // read, the checkpoint is from another input and the build starts over
+    Source rest = src;
+    const string *key = nullptr;
+    int32_t o;
+    size_t l, i = 0;
+    while (i < cp.consumed && rest.next(&key, &o, &l)) {
+      hash = MastCheckpoint::mix(hash, *key, o);
+      ++i;
+    }
+    if (i == cp.consumed && hash == cp.hash && (i == 0 || *key == cp.prev)) {
+      src = rest;
+      consumed = saved = i;
+      first = i == 0;
+      prev = cp.prev;
+      for (const auto &s : states) {
+        dict[s->hcode].push_back(s);
+      }
+      std::copy(cp.frontier.begin(), cp.frontier.end(), buf.begin());
+      cp.frontier.clear();
+      resumed = true;
+    }
+  }
+  if (!resumed) {
+    cp = MastCheckpoint();
+    hash = 0;
+    states.reserve(initialMASTSize);
+  }
+  // a checkpoint that can't be written stops checkpointing; the build goes on
+  bool checkpointing = !checkpointPath.empty();
+
+  const string *next;
+  int32_t out;
+  size_t prefixLen;
+  while (src.next(&next, &out, &prefixLen)) {
+    ++consumed;
+    if (checkpointing && consumed - 1 - saved >= checkpointInterval) {
+      cp.keysOnly = keysOnly;
+      cp.consumed = consumed - 1;
+      cp.hash = hash;
+      cp.prev = prev;
+      cp.frontier.assign(buf.begin(), buf.begin() + prev.size() + 1);
+      checkpointing = cp.Save(checkpointPath);
+      cp.frontier.clear();
+      saved = consumed - 1;
+    }
+    if (!checkpointPath.empty()) {
+      hash = MastCheckpoint::mix(hash, *next, out);
+    }
+    const auto &in = *next;
+    // in != prev, decided from the prefix length without a second comparison
+    const bool isNew = first || prefixLen != in.size() || prefixLen != prev.size();
+    first = false;
+    if (keysOnly) {
+      if (!isNew) {
+        continue;
+      }
+      out = 0;
+    }
     bool fZero = (out == 0);  // flag
-    size_t prefixLen = commonPrefixLen(in, prev);
     for (size_t i = prev.length(); i > prefixLen; --i) {
       shared_ptr<State> s;
       const auto it = dict.find(buf[i]->hcode);
@@ -781,28 +4300,29 @@ shared_ptr<Mast> buildMAST(vector<Pair> *input) {
           }
         }
       } else {
-        dict.insert(make_pair(buf[i]->hcode, vector<shared_ptr<State>>()));
+        dict[buf[i]->hcode];
       }
       if (!s) {
-        s = make_shared<State>(*buf[i]);
-        m->addState(s);
+        s = copyState(*buf[i]);
+        addState(s);
         dict.at(buf[i]->hcode).push_back(s);
       }
       buf[i]->renew();
       buf[i-1]->setTransition((uint8_t)prev[i-1], s);
     }
-    for (size_t i = prefixLen+1; i < in.length(); ++i) {
+    for (size_t i = prefixLen+1; i <= in.length(); ++i) {
       buf[i-1]->setTransition((uint8_t)in[i-1], buf[i]);
     }
-    if (in != prev) {
+    if (isNew) {
       buf[in.length()]->isFinal = true;
     }
     for (size_t j = 1; j < prefixLen+1; ++j) {
-      if (buf[j-1]->output.at((uint8_t)in[j-1]) == out) {
+      const auto o = buf[j-1]->output.find((uint8_t)in[j-1]);
+      int32_t outSuff = o != buf[j-1]->output.end() ? o->second : 0;
+      if (outSuff == out) {
         out = 0;
         break;
       }
-      int32_t outSuff = buf[j-1]->output.at((uint8_t)in[j-1]);
       buf[j-1]->removeOutput((uint8_t)in[j-1]);  // clear the prev edge
       for (const auto &elem : buf[j]->trans) {
         const auto &ch = elem.first;
@@ -812,7 +4332,13 @@ shared_ptr<Mast> buildMAST(vector<Pair> *input) {
         buf[j]->addTail(outSuff);
       }
     }
-    if (in != prev) {
+    if (isNew && in.empty()) {
+      if (!keysOnly) {
+        buf[0]->addTail(out);  // no edge to carry the output
+      }
+    } else if (isNew) {
+      // the new edge may have received a pushed-down output above
+      buf[prefixLen]->removeOutput((uint8_t)in[prefixLen]);
       buf[prefixLen]->setOutput((uint8_t)in[prefixLen], out);
     } else if (fZero || out != 0) {
       buf[in.length()]->addTail(out);
@@ -832,27 +4358,101 @@ shared_ptr<Mast> buildMAST(vector<Pair> *input) {
         }
       }
     } else {
-      dict.insert(make_pair(buf[i]->hcode, vector<shared_ptr<State>>()));
+      dict[buf[i]->hcode];
     }
     if (!s) {
-      s = make_shared<State>(*buf[i]);
+      s = copyState(*buf[i]);
       buf[i]->renew();
-      m->addState(s);
+      addState(s);
       dict.at(buf[i]->hcode).push_back(s);
     }
     buf[i-1]->setTransition((uint8_t)prev[i-1], s);
   }
-  m->initialState = buf[0];
-  m->addState(buf[0]);
+  addState(buf[0]);
+  dict.clear();
+  buf.clear();
+  m->freeze(states);
+  if (!checkpointPath.empty()) {
+    MastCheckpoint::Remove(checkpointPath);
+  }
   return m;
 }
 
-// BuildFST constructs a virtual machine of a finite state transducer from a given inputs.
-shared_ptr<FST> BuildFST(vector<Pair> *input, string *err) {
-  auto m = buildMAST(input);
-  auto ret = m->buildMachine(err);
+// buildMAST sorts input and builds its MAST.
+shared_ptr<Mast> buildMAST(vector<Pair> *input, const BuildOptions &opts = BuildOptions()) {
+  sortPairs(input, opts.sortThreads);
+  return buildSortedMAST(PairSource(input), opts);
+}
+
+// buildFST compiles the sorted keys of src, which it reads twice if a prefilter is asked for.
+template <typename Source>
+shared_ptr<FST> buildFST(Source src, size_t n, string *err, const BuildOptions &opts) {
+  auto m = buildSortedMAST(src, opts);
+  if (!opts.acceptor) {
+    m->optimizeOutputs();
+  }
+  auto ret = m->buildMachine(err, opts);
+  if (ret && opts.prefilterBitsPerKey > 0) {
+    ret->prefilter.reset(n, opts.prefilterBitsPerKey);
+    const string *in;
+    int32_t out;
+    size_t lcp;
+    while (src.next(&in, &out, &lcp)) {
+      ret->prefilter.add(*in);
+    }
+  }
   return ret;
 }
 
+// BuildFST constructs a virtual machine of a finite state transducer from a given inputs.
+// input is sorted in place.
+shared_ptr<FST> BuildFST(vector<Pair> *input, string *err,
+                         const BuildOptions &opts = BuildOptions()) {
+  sortPairs(input, opts.sortThreads);
+  return buildFST(PairSource(input), input->size(), err, opts);
+}
+
+// BuildFST constructs a virtual machine from front-coded keys, which are sorted already.
+shared_ptr<FST> BuildFST(const FrontCodedKeys &keys, string *err,
+                         const BuildOptions &opts = BuildOptions()) {
+  return buildFST(keys.reader(), keys.size(), err, opts);
+}
+
+// writeFST compiles the sorted keys of src like buildFST and streams the image to w.
+template <typename Source>
+bool writeFST(Source src, size_t n, ostream *w, string *err, const BuildOptions &opts) {
+  FST head;
+  if (opts.prefilterBitsPerKey > 0) {
+    head.prefilter.reset(n, opts.prefilterBitsPerKey);
+    auto keys = src;
+    const string *in;
+    int32_t out;
+    size_t lcp;
+    while (keys.next(&in, &out, &lcp)) {
+      head.prefilter.add(*in);
+    }
+  }
+  auto m = buildSortedMAST(src, opts);
+  if (!opts.acceptor) {
+    m->optimizeOutputs();
+  }
+  return m->writeMachine(w, err, opts, move(head));
+}
+
+// WriteFST compiles input like BuildFST and writes the image Write would, emitting
+// the program straight to w instead of building it in memory first. input is sorted
+// in place.
+bool WriteFST(vector<Pair> *input, ostream *w, string *err,
+              const BuildOptions &opts = BuildOptions()) {
+  sortPairs(input, opts.sortThreads);
+  return writeFST(PairSource(input), input->size(), w, err, opts);
+}
+
+// WriteFST streams the image of front-coded keys to w.
+bool WriteFST(const FrontCodedKeys &keys, ostream *w, string *err,
+              const BuildOptions &opts = BuildOptions()) {
+  return writeFST(keys.reader(), keys.size(), w, err, opts);
+}
+
 }  // namespace FstDict
 #endif  // FSTDICT_FST_H
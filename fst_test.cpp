@@ -1,11 +1,29 @@
 #include "fst.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 using namespace std;
 
+// CHECK is assert that also runs under NDEBUG, since the calls under test are made
+// inside it.
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      abort();                                                                 \
+    }                                                                          \
+  } while (0)
+
 void TestFSTCommonPrefixSearch01() {
   vector<FstDict::Pair> inp {
     {"こんにちは", 111},
@@ -17,9 +35,1179 @@ void TestFSTCommonPrefixSearch01() {
   string err;
   auto vm = BuildFST(&inp, &err);
   cout << vm->toString();
+
+  vector<int> lens;
+  auto outs = vm->CommonPrefixSearch("すもももももものうち", &lens);
+  CHECK(lens.size() == 2);
+  CHECK(lens[0] == 9 && (outs[0] == vector<int32_t>{333, 444}));
+  CHECK(lens[1] == 21 && (outs[1] == vector<int32_t>{333}));
+}
+
+void TestFSTSearch01() {
+  vector<FstDict::Pair> inp {
+    {"a", 1},
+    {"ab", 2},
+    {"abc", 2},
+    {"b", 0},
+    {"bc", 7},
+    {"世界", 222},
+  };
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  CHECK(vm->Search("a") == vector<int32_t>{1});
+  CHECK(vm->Search("ab") == vector<int32_t>{2});
+  CHECK(vm->Search("abc") == vector<int32_t>{2});
+  CHECK(vm->Search("b") == vector<int32_t>{0});
+  CHECK(vm->Search("bc") == vector<int32_t>{7});
+  CHECK(vm->Search("世界") == vector<int32_t>{222});
+  CHECK(vm->Search("abcd").empty());
+  CHECK(vm->Search("c").empty());
+
+  int len;
+  auto out = vm->PrefixSearch("abd", &len);
+  CHECK(len == 2 && out == vector<int32_t>{2});
+
+  stringstream ss;
+  CHECK(vm->Write(&ss));
+  FstDict::FST loaded;
+  CHECK(loaded.Read(&ss));
+  CHECK(loaded.Search("bc") == vector<int32_t>{7});
+  CHECK(loaded.Search("世界") == vector<int32_t>{222});
+}
+
+void TestFSTWarmup01() {
+  vector<FstDict::Pair> inp {
+    {"apple", 1},
+    {"apply", 2},
+    {"banana", 3},
+  };
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  for (const auto &key : vm->sampleKeys(16)) {
+    CHECK(!vm->Search(key).empty());
+  }
+  FstDict::WarmupOptions opts;
+  opts.samples = 16;
+  auto ready = vm->WarmupAsync(opts);
+  ready.get();
+
+  // the lock belongs to the warmed FST: copies don't inherit it and Unlock drops it
+  opts.lockProgram = true;
+  if (vm->Warmup(opts)) {
+    CHECK(vm->programLock.locked());
+    FstDict::FST copy = *vm;
+    CHECK(!copy.programLock.locked());
+    vm->Unlock();
+    CHECK(!vm->programLock.locked());
+  }
+}
+
+vector<FstDict::Pair> randomPairs(size_t n, uint32_t seed) {
+  vector<FstDict::Pair> inp;
+  for (size_t i = 0; i < n; ++i) {
+    string key;
+    size_t len = 1 + (seed = seed * 1103515245 + 12345) % 12;
+    for (size_t j = 0; j < len; ++j) {
+      key.push_back("abcde\xe3\x81"[(seed = seed * 1103515245 + 12345) % 7]);
+    }
+    inp.push_back({key, (int32_t)((seed = seed * 1103515245 + 12345) % 50 + 1)});
+  }
+  return inp;
+}
+
+void TestMastOptimizeOutputs01() {
+  auto inp = randomPairs(2000, 1);
+  string err;
+  auto plain = FstDict::buildMAST(&inp)->buildMachine(&err);
+  auto m = FstDict::buildMAST(&inp);
+  auto stats = m->optimizeOutputs();
+  auto vm = m->buildMachine(&err);
+  cout << "outputs: " << stats.before.outputs << " -> " << stats.after.outputs
+       << ", tails: " << stats.before.tails << " -> " << stats.after.tails
+       << ", bytes: " << stats.before.bytes << " -> " << stats.after.bytes << endl;
+  CHECK(stats.after.bytes <= stats.before.bytes);
+  for (const auto &p : inp) {
+    CHECK(vm->Search(p.in) == plain->Search(p.in));
+    vector<int> lens1, lens2;
+    auto o1 = vm->CommonPrefixSearch(p.in + "abc", &lens1);
+    auto o2 = plain->CommonPrefixSearch(p.in + "abc", &lens2);
+    CHECK(o1 == o2 && lens1 == lens2);
+  }
+}
+
+void TestMastFrozen01() {
+  vector<FstDict::Pair> inp {
+    {"ab", 1},
+    {"abc", 2},
+    {"b", 3},
+  };
+  auto m = FstDict::buildMAST(&inp);
+  CHECK(m->numStates() > 0);
+  for (size_t s = 0; s < m->numStates(); ++s) {
+    for (auto e = m->first[s]; e < m->first[s+1]; ++e) {
+      CHECK(e == m->first[s] || m->label[e-1] < m->label[e]);
+      CHECK(m->next[e] < s);
+    }
+  }
+  bool ok;
+  CHECK(m->run("abc", &ok) == vector<int32_t>{2} && ok);
+  m->run("ac", &ok);
+  CHECK(!ok);
+  CHECK(m->accept("ab") && !m->accept("ba"));
+  stringstream ss;
+  m->dot(ss);
+  CHECK(ss.str().find("digraph") == 0);
+}
+
+void TestFSTExport01() {
+  auto inp = randomPairs(500, 3);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  stringstream dot;
+  FstDict::ExportOptions opts;
+  opts.depth = 1;
+  size_t n = vm->Export(dot, opts);
+  CHECK(n > 1 && dot.str().find("digraph G {") == 0);
+
+  stringstream json;
+  opts.format = FstDict::ExportOptions::Format::Json;
+  opts.key = inp[0].in;
+  opts.depth = 0;
+  n = vm->Export(json, opts);
+  CHECK(n == inp[0].in.size() + 1);
+  CHECK(json.str().find("\"truncated\":false") != string::npos);
+
+  stringstream capped;
+  opts.key.clear();
+  opts.depth = 100;
+  opts.maxStates = 5;
+  CHECK(vm->Export(capped, opts) == 5);
+  CHECK(capped.str().find("\"truncated\":true") != string::npos);
+
+  // the caller's formatting is left as it was
+  stringstream hexed;
+  hexed << std::hex << std::showbase;
+  const auto flags = hexed.flags();
+  opts.format = FstDict::ExportOptions::Format::Dot;
+  vm->Export(hexed, opts);
+  CHECK(hexed.flags() == flags);
+  CHECK(hexed.str().find("0x") == string::npos);
+}
+
+void TestCommonPrefixLen01() {
+  string a(100, 'x');
+  for (size_t n = 0; n <= a.size(); ++n) {
+    for (size_t at = 0; at <= n; ++at) {
+      string b = a.substr(0, n);
+      if (at < n) {
+        b[at] = 'y';
+      }
+      CHECK(commonPrefixLen(a, b) == at);
+      CHECK(commonPrefixLen(b, a) == at);
+    }
+  }
+}
+
+void TestFSTContains01() {
+  auto inp = randomPairs(2000, 4);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  for (const auto &p : inp) {
+    CHECK(vm->Contains(p.in));
+    bool accept;
+    auto snap = vm->run(p.in, &accept);
+    CHECK(accept && vm->Search(p.in) == snap.back().out);
+    string miss = p.in + "z";
+    CHECK(!vm->Contains(miss) && vm->Search(miss).empty());
+    miss = p.in.substr(0, p.in.size() - 1);
+    vm->run(miss, &accept);
+    CHECK(vm->Contains(miss) == accept);
+  }
+}
+
+void TestFSTSearchSorted01() {
+  auto inp = randomPairs(2000, 5);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  vector<string> keys;
+  for (const auto &p : inp) {
+    keys.push_back(p.in);
+    keys.push_back(p.in + "a");
+    keys.push_back(p.in.substr(0, p.in.size() / 2));
+  }
+  sort(keys.begin(), keys.end());
+  size_t visited = 0;
+  vm->SearchSorted(keys, [&](size_t i, const vector<int32_t> &outs) {
+    CHECK(i == visited++);
+    CHECK(outs == vm->Search(keys[i]));
+  });
+  CHECK(visited == keys.size());
+}
+
+void collectKeys(const FstDict::Cursor &c, string *key, vector<pair<string, vector<int32_t>>> *keys) {
+  if (c.IsFinal()) {
+    auto outs = c.Outputs();
+    keys->push_back(make_pair(*key, vector<int32_t>(outs.begin(), outs.end())));
+  }
+  c.ForEachChild([&](uint8_t ch, const FstDict::Cursor &child) {
+    key->push_back((char)ch);
+    collectKeys(child, key, keys);
+    key->pop_back();
+  });
+}
+
+void TestFSTCursor01() {
+  auto inp = randomPairs(1000, 6);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  string key;
+  vector<pair<string, vector<int32_t>>> keys;
+  collectKeys(vm->Root(), &key, &keys);
+  set<string> distinct;
+  for (const auto &p : inp) {
+    distinct.insert(p.in);
+  }
+  CHECK(keys.size() == distinct.size());
+  for (size_t i = 1; i < keys.size(); ++i) {
+    CHECK(keys[i-1].first < keys[i].first);
+  }
+  for (const auto &k : keys) {
+    CHECK(vm->Search(k.first) == k.second);
+  }
+  for (const auto &p : inp) {
+    auto c = vm->Root();
+    for (auto ch : p.in) {
+      CHECK(c.Step((uint8_t)ch));
+    }
+    CHECK(c.IsFinal());
+    auto outs = c.Outputs();
+    CHECK(vector<int32_t>(outs.begin(), outs.end()) == vm->Search(p.in));
+  }
+
+  // 'a' and 'z' share a class and an edge that comes before the one of 'b'
+  vector<FstDict::Pair> interleaved = {{"a1", 1}, {"b2", 2}, {"z1", 1}};
+  auto vm2 = BuildFST(&interleaved, &err);
+  CHECK(vm2->classes['a'] == vm2->classes['z'] && vm2->classes['a'] != vm2->classes['b']);
+  keys.clear();
+  collectKeys(vm2->Root(), &key, &keys);
+  CHECK(keys.size() == 3 && keys[0].first == "a1" && keys[1].first == "b2" && keys[2].first == "z1");
+
+  // the root of an empty program is invalid, and so is everything asked of it
+  FstDict::FST empty;
+  auto root = empty.Root();
+  CHECK(!root.Valid() && !root.IsFinal() && !root.Step('a'));
+  CHECK(root.Outputs().begin() == root.Outputs().end());
+  root.ForEachChild([](uint8_t, const FstDict::Cursor &) { CHECK(false); });
+}
+
+void TestFSTOptimize01() {
+  auto inp = randomPairs(3000, 7);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  FstDict::FST opt = *vm;
+  auto stats = opt.Optimize();
+  cout << "instructions: " << stats.before.instructions << " -> " << stats.after.instructions
+       << ", far jumps: " << stats.before.farJumps << " -> " << stats.after.farJumps
+       << ", bytes: " << stats.before.bytes << " -> " << stats.after.bytes << endl;
+  CHECK(stats.after.bytes <= stats.before.bytes);
+  for (const auto &p : inp) {
+    for (const auto &key : {p.in, p.in + "b", p.in.substr(1)}) {
+      CHECK(opt.Search(key) == vm->Search(key));
+      vector<int> lens1, lens2;
+      auto o1 = opt.CommonPrefixSearch(key, &lens1);
+      auto o2 = vm->CommonPrefixSearch(key, &lens2);
+      CHECK(o1 == o2 && lens1 == lens2);
+    }
+  }
+
+  // past 64K words most parents of the Accept leaf need a far jump to reach it; with
+  // the leaf copied next to them, fewer do
+  auto big = randomPairs(80000, 9);
+  vm = BuildFST(&big, &err);
+  opt = *vm;
+  stats = opt.Optimize();
+  cout << "far jumps: " << stats.before.farJumps << " -> " << stats.after.farJumps
+       << ", bytes: " << stats.before.bytes << " -> " << stats.after.bytes << endl;
+  CHECK(stats.after.farJumps < stats.before.farJumps);
+  CHECK(stats.after.bytes < stats.before.bytes);
+  for (size_t i = 0; i < big.size(); i += 7) {
+    CHECK(opt.Search(big[i].in) == vm->Search(big[i].in));
+    CHECK(opt.Contains(big[i].in + "a") == vm->Contains(big[i].in + "a"));
+  }
+}
+
+void TestFSTSuperinstructions01() {
+  auto inp = randomPairs(3000, 8);
+  string err;
+  FstDict::BuildOptions plain;
+  plain.fuseInstructions = false;
+  auto vm0 = BuildFST(&inp, &err, plain);
+  auto vm1 = BuildFST(&inp, &err);
+  size_t d0 = 0, d1 = 0;
+  for (const auto &p : inp) {
+    for (const auto &key : {p.in, p.in + "c", p.in.substr(0, p.in.size() - 1)}) {
+      bool a0, a1;
+      auto s0 = vm0->run(key, &a0, &d0);
+      auto s1 = vm1->run(key, &a1, &d1);
+      CHECK(a0 == a1 && s0.size() == s1.size());
+      for (size_t i = 0; i < s0.size(); ++i) {
+        CHECK(s0[i].hd == s1[i].hd && s0[i].out == s1[i].out);
+      }
+      CHECK(vm1->Search(key) == vm0->Search(key));
+    }
+  }
+  cout << "dispatches per lookup: " << (double)d0 / (3 * inp.size())
+       << " -> " << (double)d1 / (3 * inp.size()) << endl;
+  CHECK(d1 < d0);
+  // every word of prog is an instruction or a far jump operand
+  for (const auto &vm : {vm0, vm1}) {
+    auto st = vm->Stats();
+    CHECK(st.instructions + st.farJumps == vm->prog.size());
+  }
+
+  stringstream ss;
+  CHECK(vm1->Write(&ss));
+  FstDict::FST loaded;
+  CHECK(loaded.Read(&ss));
+  CHECK(loaded.prog.size() == vm1->prog.size());
+  FstDict::FST opt = *vm1;
+  opt.Optimize();
+  for (const auto &p : inp) {
+    CHECK(opt.Search(p.in) == vm0->Search(p.in));
+    CHECK(loaded.Search(p.in) == vm0->Search(p.in));
+  }
+
+  // the initial state has no parent to host it, so it is never inlined
+  vector<FstDict::Pair> fork = {{"ab", 0}, {"acd", 0}};
+  auto vm2 = BuildFST(&fork, &err);
+  CHECK(vm2->Search("ab") == vector<int32_t>{0} && vm2->Search("acd") == vector<int32_t>{0});
+}
+
+void TestFSTHotColdSplit01() {
+  // large enough for far jumps, which must not end up inside a fused pair
+  auto inp = randomPairs(150000, 9);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  CHECK(vm->Stats().farJumps > 0);
+  size_t outputs = 0, tails = 0;
+  for (size_t pc = 0; pc < vm->prog.size(); ++pc) {
+    auto op = vm->prog[pc].ops.op;
+    if (op == FstDict::Operation::Accept || op == FstDict::Operation::AcceptBreak) {
+      tails += vm->prog[pc].ops.ch;
+      continue;
+    }
+    outputs += FstDict::isOutput(op);
+    if (vm->prog[pc].ops.jump == 0) {
+      ++pc;  // skip the far jump word
+    }
+  }
+  CHECK(outputs == vm->outs.size());
+  CHECK(2 * tails == vm->tailRanges.size());
+
+  stringstream ss;
+  CHECK(vm->Write(&ss));
+  FstDict::FST loaded;
+  CHECK(loaded.Read(&ss));
+  FstDict::FST opt = *vm;
+  opt.Optimize();
+  for (size_t i = 0; i < inp.size(); i += 7) {
+    auto want = vm->Search(inp[i].in);
+    CHECK(!want.empty());
+    CHECK(loaded.Search(inp[i].in) == want);
+    CHECK(opt.Search(inp[i].in) == want);
+  }
+}
+
+void TestFSTByteClasses01() {
+  // 'a' and 'b' (and 'x' and 'y') are interchangeable everywhere
+  vector<FstDict::Pair> inp = {
+    {"ax", 1}, {"bx", 1}, {"ay", 1}, {"by", 1}, {"axz", 2}, {"bxz", 2}, {"ayz", 2}, {"byz", 2},
+    {"c", 3}, {"cz", 4},
+  };
+  string err;
+  FstDict::BuildOptions raw;
+  raw.byteClasses = false;
+  auto vm0 = BuildFST(&inp, &err, raw);
+  auto vm1 = BuildFST(&inp, &err);
+  CHECK(vm1->classes['a'] == vm1->classes['b'] && vm1->classes['x'] == vm1->classes['y']);
+  CHECK(vm1->classes['a'] != vm1->classes['c'] && vm1->classes['z'] != vm1->classes['x']);
+  CHECK(vm1->classes['q'] == 0 && vm1->classes[0] == 0 && vm1->classes['a'] != 0);
+  CHECK(vm1->prog.size() < vm0->prog.size());
+
+  stringstream ss;
+  CHECK(vm1->Write(&ss));
+  FstDict::FST loaded;
+  CHECK(loaded.Read(&ss));
+  FstDict::FST opt = *vm1;
+  opt.Optimize();
+  for (const auto &key : {"ax", "by", "byz", "c", "cz", "q", "aq", "abx", "x", ""}) {
+    CHECK(vm1->Search(key) == vm0->Search(key));
+    CHECK(loaded.Search(key) == vm0->Search(key));
+    CHECK(opt.Search(key) == vm0->Search(key));
+  }
+  string key;
+  vector<pair<string, vector<int32_t>>> keys;
+  collectKeys(vm1->Root(), &key, &keys);
+  CHECK(keys.size() == inp.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    CHECK(keys[i].first == inp[i].in);
+  }
+
+  auto big = randomPairs(3000, 10);
+  vm0 = BuildFST(&big, &err, raw);
+  vm1 = BuildFST(&big, &err);
+  for (const auto &p : big) {
+    CHECK(vm1->Search(p.in) == vm0->Search(p.in));
+    CHECK(vm1->Search(p.in + "q").empty());
+  }
+}
+
+void TestFSTAcceptor01() {
+  auto inp = randomPairs(5000, 11);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  FstDict::BuildOptions opts;
+  opts.acceptor = true;
+  auto fsa = BuildFST(&inp, &err, opts);
+  CHECK(fsa->acceptor && !vm->acceptor);
+  CHECK(fsa->outs.empty() && fsa->tailRanges.empty() && fsa->data.empty());
+  CHECK(fsa->Stats().bytes < vm->Stats().bytes);
+  cout << "acceptor bytes: " << vm->Stats().bytes << " -> " << fsa->Stats().bytes << endl;
+
+  stringstream ss;
+  CHECK(fsa->Write(&ss));
+  stringstream ts;
+  CHECK(vm->Write(&ts));
+  CHECK(ss.str().size() < ts.str().size());
+  FstDict::FST loaded;
+  CHECK(loaded.Read(&ss));
+  CHECK(loaded.acceptor);
+  FstDict::FST opt = *fsa;
+  opt.Optimize();
+  CHECK(opt.acceptor);
+  for (const auto &p : inp) {
+    for (const auto &key : {p.in, p.in + "c", p.in.substr(0, p.in.size() - 1)}) {
+      bool want = vm->Contains(key);
+      CHECK(fsa->Contains(key) == want && loaded.Contains(key) == want && opt.Contains(key) == want);
+      vector<int> lens, want_lens;
+      vm->CommonPrefixSearch(key, &want_lens);
+      fsa->CommonPrefixLengths(key, &lens);
+      CHECK(lens == want_lens);
+      CHECK(fsa->LongestPrefixLength(key) == (lens.empty() ? -1 : lens.back()));
+    }
+  }
+}
+
+void TestFSTVerify01() {
+  auto inp = randomPairs(2000, 12);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  CHECK(vm->Verify(&err));
+  FstDict::FST opt = *vm;
+  opt.Optimize();
+  CHECK(opt.Verify(&err));
+  FstDict::BuildOptions opts;
+  opts.acceptor = true;
+  CHECK(BuildFST(&inp, &err, opts)->Verify(&err));
+  auto big = randomPairs(150000, 9);
+  CHECK(BuildFST(&big, &err)->Verify(&err));
+
+  FstDict::FST bad = *vm;
+  bad.outs.pop_back();
+  CHECK(!bad.Verify(&err));
+  bad = *vm;
+  bad.tailRanges.back() = (int32_t)bad.data.size() + 1;
+  CHECK(!bad.Verify(&err));
+  bad = *vm;
+  bad.prog.pop_back();
+  CHECK(!bad.Verify(&err));
+  bad = *vm;
+  for (auto &code : bad.prog) {
+    if (code.ops.op == FstDict::Operation::Match && code.ops.jump > 0) {
+      code.ops.jump = (uint16_t)(bad.prog.size());  // past the end
+      break;
+    }
+  }
+  CHECK(!bad.Verify(&err));
+  // an Accept among a state's edges hides the edges after it from the state walk,
+  // which would let run step to pcs that have no reachability entry
+  using FstDict::Operation;
+  auto word = [](Operation op, char ch, uint16_t jump) {
+    FstDict::Instruction code;
+    code.ops.op = op;
+    code.ops.ch = (uint8_t)ch;
+    code.ops.jump = jump;
+    return code;
+  };
+  FstDict::FST midAccept;
+  midAccept.prog = {word(Operation::Match, 'a', 3), word(Operation::Accept, 0, 0),
+                    word(Operation::Break, 'b', 4), word(Operation::Break, 'x', 1),
+                    word(Operation::Break, 'y', 1), word(Operation::AcceptBreak, 0, 0),
+                    word(Operation::Break, 'c', 1), word(Operation::AcceptBreak, 0, 0)};
+  midAccept.acceptor = true;
+  CHECK(!midAccept.Verify(&err) && err == "Accept inside a state at pc 1");
+  stringstream midImage;
+  CHECK(midAccept.Write(&midImage));
+  {
+    auto cerrBuf = cerr.rdbuf(nullptr);
+    FstDict::FST loaded;
+    const bool ok = loaded.Read(&midImage);
+    cerr.rdbuf(cerrBuf);
+    CHECK(!ok);
+    vector<int> lens;
+    CHECK(loaded.CommonPrefixSearch("bcq", &lens).empty());
+  }
+
+  // lookups treat a program that failed Verify, or was never indexed, as empty
+  CHECK(vm->verified && !bad.index(&err) && !bad.verified);
+  CHECK(bad.Search(inp[0].in).empty() && !bad.Contains(inp[0].in) && !bad.Root().Valid());
+  FstDict::FST raw;
+  raw.prog = vm->prog;
+  raw.data = vm->data;
+  raw.outs = vm->outs;
+  raw.tailRanges = vm->tailRanges;
+  raw.classes = vm->classes;
+  CHECK(!raw.Contains(inp[0].in) && raw.LongestPrefixLength(inp[0].in) < 0);
+  CHECK(raw.index() && raw.Contains(inp[0].in) == vm->Contains(inp[0].in));
+
+  stringstream ss;
+  CHECK(vm->Write(&ss));
+  const string image = ss.str();
+  auto cerrBuf = cerr.rdbuf(nullptr);
+  FstDict::FST loaded;
+  stringstream truncated(image.substr(0, image.size() / 2));
+  CHECK(!loaded.Read(&truncated) && loaded.prog.empty());
+
+  // corrupt images are either rejected or safe to run
+  uint32_t seed = 12;
+  size_t rejected = 0;
+  for (int i = 0; i < 300; ++i) {
+    string corrupt = image;
+    for (int k = 0; k < 4; ++k) {
+      seed = seed * 1103515245 + 12345;
+      corrupt[(seed >> 8) % corrupt.size()] ^= (char)(1 + (seed >> 3) % 255);
+    }
+    stringstream cs(corrupt);
+    FstDict::FST f;
+    if (!f.Read(&cs)) {
+      ++rejected;
+      continue;
+    }
+    vector<int> lens;
+    for (size_t j = 0; j < 50; ++j) {
+      f.Search(inp[j].in);
+      f.CommonPrefixSearch(inp[j].in + "abc", &lens);
+    }
+  }
+  cerr.rdbuf(cerrBuf);
+  CHECK(rejected > 0);
+}
+
+void TestFSTReachability01() {
+  auto inp = randomPairs(3000, 13);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  size_t shortest = 100, longest = 0;
+  for (const auto &p : inp) {
+    shortest = min(shortest, p.in.size());
+    longest = max(longest, p.in.size());
+  }
+  CHECK(vm->minKeyLen == shortest && vm->maxKeyLen == longest);
+  for (auto d : vm->minBelow) {
+    CHECK(d <= vm->minBelowMax || d == 255);
+  }
+  CHECK(vm->Search(string(longest + 1, 'a')).empty());
+  // only state starts have an entry; any other pc is never out of reach
+  CHECK(vm->minBelowMax > 0);
+  for (size_t pc = 0; pc < vm->prog.size(); ++pc) {
+    CHECK(vm->stateIndex.marked(pc) || !vm->outOfReach((int)pc, 0));
+  }
+
+  // early stops must not change any result
+  uint32_t seed = 13;
+  for (const auto &p : inp) {
+    seed = seed * 1103515245 + 12345;
+    string text = p.in + inp[seed % inp.size()].in;
+    vector<int> lens, want;
+    vm->CommonPrefixSearch(text, &lens);
+    for (size_t n = 0; n <= text.size(); ++n) {
+      if (vm->Contains(text.substr(0, n))) {
+        want.push_back((int)n);
+      }
+    }
+    CHECK(lens == want);
+    vm->CommonPrefixLengths(text, &lens);
+    CHECK(lens == want);
+  }
+}
+
+void TestFSTContainsBatch01() {
+  auto inp = randomPairs(3000, 14);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  vector<string> keys;
+  uint32_t seed = 14;
+  for (const auto &p : inp) {
+    keys.push_back(p.in);
+    seed = seed * 1103515245 + 12345;
+    keys.push_back(p.in.substr(0, seed % (p.in.size() + 1)) + (seed & 1 ? "a" : ""));
+  }
+  keys.push_back("");
+  keys.push_back("zzz");
+  vector<char> want(keys.size()), got;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    want[i] = vm->Contains(keys[i]);
+  }
+  vm->ContainsBatch(keys, &got);  // no table yet: scalar lookups
+  CHECK(got == want);
+
+  CHECK(!vm->BuildDenseTable(16) && vm->dense.empty());
+  CHECK(vm->BuildDenseTable());
+  CHECK(vm->dense.width < 16 && vm->dense.cells.size() == vm->minBelow.size() * vm->dense.width);
+  vm->ContainsBatch(keys, &got);
+  CHECK(got == want);
+
+  FstDict::BuildOptions opts;
+  opts.acceptor = true;
+  auto fsa = BuildFST(&inp, &err, opts);
+  CHECK(fsa->BuildDenseTable());
+  fsa->ContainsBatch(keys, &got);
+  CHECK(got == want);
+}
+
+void TestFSTPrefilter01() {
+  auto inp = randomPairs(20000, 15);
+  string err;
+  auto plain = BuildFST(&inp, &err);
+  FstDict::BuildOptions opts;
+  opts.prefilterBitsPerKey = 10;
+  auto vm = BuildFST(&inp, &err, opts);
+  CHECK(!vm->prefilter.empty() && vm->Stats().prefilterBytes == vm->prefilter.bytes());
+
+  stringstream ss;
+  CHECK(vm->Write(&ss));
+  FstDict::FST loaded;
+  CHECK(loaded.Read(&ss));
+  CHECK(loaded.prefilter.words == vm->prefilter.words);
+  FstDict::FST opt = *vm;
+  opt.Optimize();
+  CHECK(!opt.prefilter.empty());
+  for (const auto &p : inp) {
+    CHECK(vm->prefilter.mayContain(p.in));
+    CHECK(vm->Search(p.in) == plain->Search(p.in));
+    CHECK(loaded.Search(p.in) == plain->Search(p.in));
+    CHECK(opt.Search(p.in) == plain->Search(p.in));
+  }
+
+  size_t misses = 0, passed = 0;
+  for (const auto &p : randomPairs(20000, 16)) {
+    if (!plain->Contains(p.in)) {
+      ++misses;
+      passed += vm->prefilter.mayContain(p.in);
+      CHECK(!vm->Contains(p.in));
+    }
+  }
+  double fpr = (double)passed / misses;
+  cout << "prefilter: " << vm->prefilter.bytes() << " bytes for " << inp.size()
+       << " keys, fpr " << fpr << " (expected " << vm->prefilter.expectedFpr(inp.size()) << ")"
+       << endl;
+  CHECK(misses > 1000 && fpr < 0.03);
+
+  // SearchSorted skips the keys the filter rules out without losing its place
+  vector<string> batch;
+  for (const auto &p : randomPairs(4000, 16)) {
+    batch.push_back(p.in);
+    batch.push_back(inp[batch.size() % inp.size()].in);
+  }
+  sort(batch.begin(), batch.end());
+  vector<vector<int32_t>> want(batch.size()), got(batch.size());
+  plain->SearchSorted(batch, [&](size_t i, vector<int32_t> outs) { want[i] = move(outs); });
+  vm->SearchSorted(batch, [&](size_t i, vector<int32_t> outs) { got[i] = move(outs); });
+  CHECK(got == want);
+}
+
+void TestSortPairs01() {
+  auto inp = randomPairs(50000, 17);
+  for (size_t i = 0; i < inp.size(); i += 3) {
+    inp[i].in = "shared/prefix/" + inp[i].in;  // long common prefixes
+  }
+  inp.push_back({string("a\0b", 3), 1});
+  inp.push_back({string("a\0", 2), 2});
+  inp.push_back({"", 3});
+  for (unsigned threads : {1u, 4u}) {
+    auto want = inp, got = inp;
+    stable_sort(want.begin(), want.end());
+    FstDict::sortPairs(&got, threads);
+    CHECK(got.size() == want.size());
+    for (size_t i = 0; i < got.size(); ++i) {
+      CHECK(got[i].in == want[i].in);
+    }
+    // equal keys keep their outputs
+    multiset<pair<string, int32_t>> a, b;
+    for (size_t i = 0; i < got.size(); ++i) {
+      a.insert(make_pair(got[i].in, got[i].out));
+      b.insert(make_pair(want[i].in, want[i].out));
+    }
+    CHECK(a == b);
+  }
+  // a common prefix of 0x00 bytes is skipped like any other
+  auto zeros = randomPairs(20000, 18);
+  for (auto &p : zeros) {
+    p.in = string(40, '\0') + p.in;
+  }
+  auto want = zeros;
+  stable_sort(want.begin(), want.end());
+  FstDict::sortPairs(&zeros);
+  for (size_t i = 0; i < zeros.size(); ++i) {
+    CHECK(zeros[i].in == want[i].in);
+  }
+
+  auto sorted = inp;
+  stable_sort(sorted.begin(), sorted.end());
+  auto copy = sorted;
+  FstDict::sortPairs(&copy);
+  for (size_t i = 0; i < copy.size(); ++i) {
+    CHECK(copy[i].in == sorted[i].in && copy[i].out == sorted[i].out);  // left untouched
+  }
+}
+
+void TestFSTEmptyKey01() {
+  // the empty key has no edge to carry its output, so it is a tail of the initial state
+  vector<FstDict::Pair> inp = {{"", 5}, {"", 6}, {"a", 1}, {"ab", 2}};
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  CHECK(vm->Search("") == (vector<int32_t>{5, 6}) && vm->Contains(""));
+  CHECK(vm->Search("a") == vector<int32_t>{1} && vm->Search("ab") == vector<int32_t>{2});
+  vector<int> lens;
+  auto outs = vm->CommonPrefixSearch("abc", &lens);
+  CHECK((lens == vector<int>{0, 1, 2}));
+  FstDict::BuildOptions opts;
+  opts.acceptor = true;
+  CHECK(BuildFST(&inp, &err, opts)->Contains(""));
+}
+
+void TestFrontCodedKeys01() {
+  auto inp = randomPairs(20000, 18);
+  inp.push_back({"", 7});
+  inp.push_back({string(1000, 'a'), 8});
+  FstDict::sortPairs(&inp);
+  FstDict::FrontCodedKeys keys;
+  size_t pairBytes = 0;
+  for (const auto &p : inp) {
+    CHECK(keys.Add(p.in, p.out));
+    pairBytes += sizeof(p) + (p.in.size() > 15 ? p.in.capacity() + 1 : 0);
+  }
+  CHECK(!keys.Add("a", 1) && keys.size() == inp.size());
+  CHECK(keys.maxKeyLen() == 1000);
+  cout << "front-coded keys: " << pairBytes << " -> " << keys.bytes() << " bytes" << endl;
+  CHECK(keys.bytes() < pairBytes);
+
+  auto r = keys.reader();
+  const string *in;
+  int32_t out;
+  size_t lcp;
+  for (const auto &p : inp) {
+    CHECK(r.next(&in, &out, &lcp) && *in == p.in && out == p.out);
+  }
+  CHECK(!r.next(&in, &out, &lcp));
+
+  string err;
+  auto want = BuildFST(&inp, &err);
+  auto got = BuildFST(keys, &err);
+  CHECK(got->Search("") == vector<int32_t>{7});
+  CHECK(got->prog.size() == want->prog.size() && got->outs == want->outs);
+  for (const auto &p : inp) {
+    CHECK(got->Search(p.in) == want->Search(p.in));
+  }
+  FstDict::BuildOptions opts;
+  opts.acceptor = true;
+  opts.prefilterBitsPerKey = 8;
+  got = BuildFST(keys, &err, opts);
+  for (const auto &p : inp) {
+    CHECK(got->Contains(p.in));
+  }
+}
+
+void TestFSTEmitThreads01() {
+  auto inp = randomPairs(150000, 9);
+  string err;
+  auto serial = BuildFST(&inp, &err);
+  CHECK(serial->Stats().farJumps > 0);
+  FstDict::BuildOptions opts;
+  opts.emitThreads = 4;
+  auto parallel = BuildFST(&inp, &err, opts);
+  CHECK(parallel->prog.size() == serial->prog.size());
+  for (size_t pc = 0; pc < serial->prog.size(); ++pc) {
+    CHECK(parallel->prog[pc].v32 == serial->prog[pc].v32);
+  }
+  CHECK(parallel->outs == serial->outs);
+  CHECK(parallel->data == serial->data);
+  CHECK(parallel->tailRanges == serial->tailRanges);
+}
+
+void TestWriteFST01() {
+  auto inp = randomPairs(150000, 9);
+  string err;
+  FstDict::BuildOptions acceptor;
+  acceptor.acceptor = true;
+  acceptor.prefilterBitsPerKey = 8;
+  FstDict::BuildOptions raw;
+  raw.byteClasses = false;
+  raw.fuseInstructions = false;
+  for (const auto &opts : {FstDict::BuildOptions(), acceptor, raw}) {
+    stringstream want, got;
+    CHECK(BuildFST(&inp, &err, opts)->Write(&want));
+    CHECK(WriteFST(&inp, &got, &err, opts));
+    CHECK(got.str() == want.str());
+  }
+
+  FstDict::FrontCodedKeys keys;
+  for (const auto &p : inp) {
+    keys.Add(p.in, p.out);
+  }
+  stringstream ss;
+  CHECK(WriteFST(keys, &ss, &err));
+  FstDict::FST vm;
+  CHECK(vm.Read(&ss));
+  for (size_t i = 0; i < inp.size(); i += 7) {
+    CHECK(!vm.Search(inp[i].in).empty());
+  }
+}
+
+// PreemptedSource stops the build like a killed process after limit keys.
+struct PreemptedSource : FstDict::PairSource {
+  size_t limit;
+
+  PreemptedSource(const vector<FstDict::Pair> *p, size_t limit) : PairSource(p), limit(limit) {}
+
+  bool next(const string **in, int32_t *out, size_t *lcp) {
+    if (i == limit) {
+      throw runtime_error("preempted");
+    }
+    return PairSource::next(in, out, lcp);
+  }
+};
+
+void TestBuildCheckpoint01() {
+  auto inp = randomPairs(20000, 11);
+  FstDict::sortPairs(&inp);
+  const string path = "fst_test.checkpoint";
+  std::remove(path.c_str());
+  string err;
+  FstDict::BuildOptions opts;
+  opts.checkpointPath = path;
+  opts.checkpointInterval = 1000;
+  auto same = [](FstDict::FST *a, FstDict::FST *b) {
+    stringstream x, y;
+    return a->Write(&x) && b->Write(&y) && x.str() == y.str();
+  };
+
+  for (bool acceptor : {false, true}) {
+    opts.acceptor = acceptor;
+    FstDict::BuildOptions plain;
+    plain.acceptor = acceptor;
+    auto want = BuildFST(&inp, &err, plain);
+    try {
+      buildFST(PreemptedSource(&inp, 12345), inp.size(), &err, opts);
+      CHECK(false);
+    } catch (const runtime_error &) {
+    }
+    CHECK(ifstream(path).good() && ifstream(path + ".states").good());
+    auto got = BuildFST(&inp, &err, opts);
+    CHECK(same(got.get(), want.get()));
+    CHECK(!ifstream(path).good() && !ifstream(path + ".states").good());
+  }
+
+  // a checkpoint of keys that differ before its last key is ignored
+  opts.acceptor = false;
+  auto changed = inp;
+  changed[100].out += 1;
+  try {
+    buildFST(PreemptedSource(&changed, 12345), changed.size(), &err, opts);
+    CHECK(false);
+  } catch (const runtime_error &) {
+  }
+  auto plain = BuildFST(&inp, &err);
+  CHECK(same(BuildFST(&inp, &err, opts).get(), plain.get()));
+
+  // a checkpoint that can't be written doesn't stop the build
+  FstDict::BuildOptions unwritable = opts;
+  unwritable.checkpointPath = "fst_test.no-such-dir/checkpoint";
+  CHECK(same(BuildFST(&inp, &err, unwritable).get(), plain.get()));
+
+  // a checkpoint of other keys is ignored
+  try {
+    buildFST(PreemptedSource(&inp, 5000), inp.size(), &err, opts);
+  } catch (const runtime_error &) {
+  }
+  auto other = randomPairs(3000, 12);
+  auto want = BuildFST(&other, &err);
+  auto got = BuildFST(&other, &err, opts);
+  CHECK(same(got.get(), want.get()));
+}
+
+void TestSentenceCache01() {
+  auto inp = randomPairs(3000, 13);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  vector<string> sentences;
+  for (size_t i = 0; i + 3 < inp.size(); i += 3) {
+    sentences.push_back(inp[i].in + "x" + inp[i+1].in + inp[i+2].in);
+  }
+
+  // a lattice is CommonPrefixSearch at every offset
+  vector<FstDict::LatticeHit> hits;
+  vector<int32_t> outs;
+  vm->Lattice(sentences[0], &hits, &outs);
+  size_t k = 0;
+  for (size_t begin = 0; begin < sentences[0].size(); ++begin) {
+    vector<int> lens;
+    auto want = vm->CommonPrefixSearch(sentences[0].substr(begin), &lens);
+    for (size_t j = 0; j < lens.size(); ++j) {
+      if (lens[j] == 0) {
+        continue;
+      }
+      CHECK(k < hits.size() && hits[k].begin == begin && (int)hits[k].len == lens[j]);
+      CHECK(vector<int32_t>(outs.begin() + hits[k].from, outs.begin() + hits[k].to) == want[j]);
+      ++k;
+    }
+  }
+  CHECK(k == hits.size());
+
+  // the cache answers like the FST, within its budget
+  for (size_t budget : {size_t(8) << 20, size_t(64) << 10}) {
+    FstDict::SentenceCache cache(budget);
+    for (int round = 0; round < 3; ++round) {
+      for (size_t i = 0; i < sentences.size(); i += 1 + round) {
+        vector<FstDict::LatticeHit> want, got;
+        vector<int32_t> wantOuts, gotOuts;
+        vm->Lattice(sentences[i], &want, &wantOuts);
+        cache.Lattice(*vm, sentences[i], &got, &gotOuts);
+        CHECK(got.size() == want.size() && gotOuts == wantOuts);
+        for (size_t j = 0; j < got.size(); ++j) {
+          CHECK(got[j].begin == want[j].begin && got[j].len == want[j].len &&
+                got[j].from == want[j].from && got[j].to == want[j].to);
+        }
+      }
+    }
+    // each miss adds an entry, which is held or was evicted once
+    auto st = cache.Stats();
+    CHECK(st.bytes <= budget && st.entries > 0);
+    CHECK(st.entries + st.evictions == st.lookups - st.hits);
+    if (budget > 100000) {
+      size_t distinct = set<string>(sentences.begin(), sentences.end()).size();
+      CHECK(st.hits == st.lookups - distinct && st.evictions == 0);
+    } else {
+      CHECK(st.evictions > 0);
+    }
+    cout << "sentence cache: budget " << budget << ", hit rate " << st.hitRate()
+         << ", " << st.entries << " entries, " << st.bytes << " bytes" << endl;
+  }
+
+  // a sentence in use survives each eviction by being copied forward, and is
+  // neither counted twice nor as evicted
+  FstDict::SentenceCache cache(size_t(64) << 10);
+  vector<FstDict::LatticeHit> got;
+  vector<int32_t> gotOuts;
+  for (size_t i = 1; i < sentences.size(); ++i) {
+    cache.Lattice(*vm, sentences[i], &got, &gotOuts);
+    cache.Lattice(*vm, sentences[0], &got, &gotOuts);
+  }
+  auto st = cache.Stats();
+  CHECK(st.evictions > 0 && st.hits >= sentences.size() - 2);
+  CHECK(st.entries + st.evictions == st.lookups - st.hits);
+}
+
+void TestLatticeLines01() {
+  auto inp = randomPairs(3000, 17);
+  string err;
+  auto vm = BuildFST(&inp, &err);
+  vector<string> lines;
+  for (size_t i = 0; i + 2 < inp.size(); i += 2) {
+    lines.push_back(i % 50 == 0 ? string() : inp[i].in + " " + inp[i+1].in);
+    if (i % 7 == 0) {
+      lines.push_back(lines[lines.size() / 2]);  // repeated lines
+    }
+  }
+  string text;
+  for (const auto &l : lines) {
+    text += l + "\n";
+  }
+  text += "abc";  // no newline at the end
+  lines.push_back("abc");
+
+  // every line gets the lattice FST::Lattice computes for it
+  for (unsigned threads : {1u, 2u, 4u}) {
+    FstDict::PipelineOptions opts;
+    opts.threads = threads;
+    opts.chunkBytes = 512;
+    opts.cacheBytes = threads == 2 ? 0 : 1 << 20;
+    vector<FstDict::LatticeHit> want;
+    vector<int32_t> wantOuts;
+    auto st = LatticeLines(*vm, text, [&](size_t n, const string &line,
+                                          FstDict::HitSpan hits, FstDict::OutputSpan outs) {
+      CHECK(n < lines.size() && line == lines[n]);
+      vm->Lattice(line, &want, &wantOuts);
+      CHECK(hits.size() == want.size() &&
+            vector<int32_t>(outs.begin(), outs.end()) == wantOuts);
+      for (size_t j = 0; j < hits.size(); ++j) {
+        CHECK(hits[j].begin == want[j].begin && hits[j].len == want[j].len &&
+              hits[j].from == want[j].from && hits[j].to == want[j].to);
+      }
+    }, opts);
+    CHECK(st.lines == lines.size() && st.bytes == text.size() && st.chunks > 1);
+  }
+
+  // throughput, with a visitor that only counts hits so the workers do the work;
+  // a loop over FST::Lattice is the serial reference
+  string big;
+  for (int i = 0; i < 20; ++i) {
+    big += text + "\n";
+  }
+  vector<FstDict::LatticeHit> hits;
+  vector<int32_t> outs;
+  size_t serialHits = 0;
+  auto started = chrono::steady_clock::now();
+  for (int i = 0; i < 20; ++i) {
+    for (const auto &line : lines) {
+      vm->Lattice(line, &hits, &outs);
+      serialHits += hits.size();
+    }
+  }
+  const double serial = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+  cout << "lattice lines: serial, " << big.size() / 1e6 / serial << " MB/s" << endl;
+  for (unsigned threads : {1u, 2u, 4u}) {
+    FstDict::PipelineOptions opts;
+    opts.threads = threads;
+    size_t counted = 0;
+    auto st = LatticeLines(*vm, big, [&](size_t, const string &, FstDict::HitSpan h,
+                                         FstDict::OutputSpan) { counted += h.size(); }, opts);
+    CHECK(counted == serialHits && st.hits == serialHits);
+    cout << "lattice lines: " << threads << " threads, " << st.mbPerSecond() << " MB/s" << endl;
+  }
+
+  // an exception from the visitor stops the workers and reaches the caller
+  for (unsigned threads : {1u, 4u}) {
+    FstDict::PipelineOptions opts;
+    opts.threads = threads;
+    opts.chunkBytes = 64;
+    size_t visited = 0;
+    try {
+      LatticeLines(*vm, text, [&](size_t n, const string &, FstDict::HitSpan, FstDict::OutputSpan) {
+        visited = n + 1;
+        if (n == 100) {
+          throw runtime_error("visitor");
+        }
+      }, opts);
+      CHECK(false);
+    } catch (const runtime_error &e) {
+      CHECK(string(e.what()) == "visitor" && visited == 101);
+    }
+  }
+}
+
+#ifdef FSTDICT_HAS_PMR
+// CountingResource counts what it hands out from the default resource.
+struct CountingResource : std::pmr::memory_resource {
+  size_t allocated = 0;
+
+  void *do_allocate(size_t bytes, size_t align) override {
+    allocated += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, align);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t align) override {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &that) const noexcept override {
+    return this == &that;
+  }
+};
+
+void TestMemoryResource01() {
+  auto inp = randomPairs(5000, 19);
+  string err;
+  auto want = BuildFST(&inp, &err);
+
+  // the builder runs out of an arena released in one go
+  CountingResource counting;
+  FstDict::BuildOptions opts;
+  {
+    std::pmr::monotonic_buffer_resource arena(&counting);
+    opts.memory = &arena;
+    auto got = BuildFST(&inp, &err, opts);
+    stringstream x, y;
+    CHECK(got->Write(&x) && want->Write(&y) && x.str() == y.str());
+  }
+  CHECK(counting.allocated > 0);
+
+  // a build resumed from a checkpoint reads the saved states into the resource too
+  const string path = "fst_test.pmr.checkpoint";
+  opts.memory = &counting;
+  opts.checkpointPath = path;
+  opts.checkpointInterval = inp.size() - 2;
+  counting.allocated = 0;
+  try {
+    buildFST(PreemptedSource(&inp, inp.size() - 1), inp.size(), &err, opts);
+    CHECK(false);
+  } catch (const runtime_error &) {
+  }
+  const size_t full = counting.allocated;
+  counting.allocated = 0;
+  auto resumed = BuildFST(&inp, &err, opts);
+  stringstream x, y;
+  CHECK(resumed->Write(&x) && want->Write(&y) && x.str() == y.str());
+  cout << "resumed build: " << counting.allocated << " of " << full << " bytes from the resource" << endl;
+  CHECK(counting.allocated > full / 2);
+  opts = FstDict::BuildOptions();
+
+  // queries fill buffers that never touch the heap
+  char buf[1 << 16];
+  for (size_t i = 0; i < inp.size(); i += 13) {
+    std::pmr::monotonic_buffer_resource request(buf, sizeof(buf), std::pmr::null_memory_resource());
+    std::pmr::vector<int32_t> outs(&request);
+    CHECK(want->Search(inp[i].in, &outs));
+    CHECK(vector<int32_t>(outs.begin(), outs.end()) == want->Search(inp[i].in));
+    std::pmr::vector<int> lens(&request);
+    want->CommonPrefixLengths(inp[i].in, &lens);
+    CHECK(!lens.empty() && lens.back() == (int)inp[i].in.size());
+    std::pmr::vector<FstDict::LatticeHit> hits(&request);
+    outs.clear();
+    want->Lattice(inp[i].in + inp[i].in, &hits, &outs);
+    CHECK(!hits.empty());
+  }
 }
+#endif
 
 int main(void) {
   TestFSTCommonPrefixSearch01();
+  TestFSTSearch01();
+  TestFSTWarmup01();
+  TestMastOptimizeOutputs01();
+  TestMastFrozen01();
+  TestFSTExport01();
+  TestCommonPrefixLen01();
+  TestFSTContains01();
+  TestFSTSearchSorted01();
+  TestFSTCursor01();
+  TestFSTOptimize01();
+  TestFSTSuperinstructions01();
+  TestFSTHotColdSplit01();
+  TestFSTByteClasses01();
+  TestFSTAcceptor01();
+  TestFSTVerify01();
+  TestFSTReachability01();
+  TestFSTContainsBatch01();
+  TestFSTPrefilter01();
+  TestSortPairs01();
+  TestFSTEmptyKey01();
+  TestFrontCodedKeys01();
+  TestFSTEmitThreads01();
+  TestWriteFST01();
+  TestBuildCheckpoint01();
+  TestSentenceCache01();
+  TestLatticeLines01();
+#ifdef FSTDICT_HAS_PMR
+  TestMemoryResource01();
+#endif
   return 0;
 }